@@ -1,43 +1,566 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <regex.h>
+#include <signal.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HTTPCPP_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
 
+#include <cctype>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <algorithm>
+#include <fstream>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
 
 #include "httpcpp.h"
 
+static string to_lower(const string& s) {
+    string lower = s;
+    for (size_t i = 0; i < lower.size(); i++) {
+        lower[i] = tolower(lower[i]);
+    }
+    return lower;
+}
+
+static unsigned long long random_seed() {
+    // from the kernel rather than srandom(), which the application owns
+    unsigned long long seed = 0;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+        seed = ((unsigned long long)IOLoop::micros() << 16) ^ getpid();
+    }
+    return seed != 0 ? seed : 88172645463325252ULL;
+}
+
+static unsigned long long next_random(unsigned long long& state) {
+    // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static bool is_address(const string& host) {
+    unsigned char buffer[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, host.data(), buffer) == 1 ||
+        inet_pton(AF_INET6, host.data(), buffer) == 1;
+}
+
+static socklen_t unix_address(const string& path, struct sockaddr_un* addr) {
+    // a leading @ stands for the NUL of the abstract namespace
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+        throw runtime_error("Invalid socket path " + path);
+    }
+    memcpy(addr->sun_path, path.data(), path.size());
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + path.size();
+    }
+    return sizeof(struct sockaddr_un);
+}
+
+static bool is_unix(const string& host) {
+    return host.compare(0, 5, "unix:") == 0;
+}
+
+static bool set_option(const int& fd, const int& level, const int& name,
+    const int& value) {
+    return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+}
+
+static bool tune_socket(const int& fd, const SocketOptions& options,
+    const bool& listening) {
+    if (options.send_buffer > 0 && 
+        !set_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer)) {
+        return false;
+    }
+    if (options.receive_buffer > 0 && 
+        !set_option(fd, SOL_SOCKET, SO_RCVBUF, options.receive_buffer)) {
+        return false;
+    }
+    // the rest is for TCP only, Unix domain sockets are left as they are
+    int protocol = 0;
+    socklen_t protocol_len = sizeof(protocol);
+    if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, 
+        &protocol_len) < 0 || protocol != IPPROTO_TCP) {
+        return true;
+    }
+    if (options.nodelay && !set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1)) {
+        return false;
+    }
+    if (options.quickack && !set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1)) {
+        return false;
+    }
+    if (options.keepalive_idle > 0) {
+        if (!set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1) ||
+            !set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, 
+                options.keepalive_idle) ||
+            (options.keepalive_interval > 0 && !set_option(fd, IPPROTO_TCP, 
+                TCP_KEEPINTVL, options.keepalive_interval)) ||
+            (options.keepalive_count > 0 && !set_option(fd, IPPROTO_TCP, 
+                TCP_KEEPCNT, options.keepalive_count))) {
+            return false;
+        }
+    }
+    if (listening) {
+        if (options.defer_accept > 0 && !set_option(fd, IPPROTO_TCP, 
+            TCP_DEFER_ACCEPT, options.defer_accept)) {
+            return false;
+        }
+        if (options.fastopen > 0 && !set_option(fd, IPPROTO_TCP, 
+            TCP_FASTOPEN, options.fastopen)) {
+            return false;
+        }
+    } else if (options.fastopen > 0) {
+        // connect() returns right away and the first write goes with the
+        // SYN, or waits for the handshake if the host has no cookie for us
+        if (!set_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int open_stream(const string& address, const int& port,
+    const SocketOptions& options=SocketOptions()) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    if (is_unix(address)) {
+        addr_len = unix_address(address.substr(5), (struct sockaddr_un*)&addr);
+    } else if (address.find(':') == string::npos) {
+        struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        if (inet_pton(AF_INET, address.data(), &in->sin_addr) <= 0) {
+            throw runtime_error("Invalid address " + address);
+        }
+        addr_len = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, address.data(), &in6->sin6_addr) <= 0) {
+            throw runtime_error("Invalid address " + address);
+        }
+        addr_len = sizeof(struct sockaddr_in6);
+    }
+    int fd;
+    if ((fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        throw runtime_error(strerror(errno));
+    }
+    if (!tune_socket(fd, options, false)) {
+        int error = errno;
+        close(fd);
+        throw runtime_error(strerror(error));
+    }
+    // the connection completes, or fails, when the socket becomes writable
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) < 0 && 
+        errno != EINPROGRESS) {
+        int error = errno;
+        close(fd);
+        throw runtime_error(strerror(error));
+    }
+    return fd;
+}
+
+// TLS streams, which fall back to plain sockets when built without TLS=1
+
+#ifdef HTTPCPP_TLS
+static string tls_error() {
+    char buffer[256];
+    unsigned long code = ERR_peek_last_error();
+    if (code == 0) {
+        return errno != 0 ? strerror(errno) : "TLS error";
+    }
+    ERR_error_string_n(code, buffer, sizeof(buffer));
+    return buffer;
+}
+
+static ssize_t tls_status(ssl_st* const stream, const int& n) {
+    // follow the conventions of read() and send() for the callers
+    switch (SSL_get_error(stream, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) {
+                errno = EIO;
+            }
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+static void tls_configure(ssl_ctx_st* const context) {
+    // records are encrypted by the kernel once the keys are known where kTLS
+    // is available, and a peer may close without notifying
+    SSL_CTX_set_options(context, 
+        SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // the write buffers shrink between partial writes
+    SSL_CTX_set_mode(context, 
+        SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+static int tls_socket_write(BIO* bio, const char* data, int size) {
+    // the sockets of OpenSSL write with write(), which raises SIGPIPE on a
+    // closed peer, and SIGPIPE belongs to the application
+    static int (*socket_write)(BIO*, const char*, int) = 
+        BIO_meth_get_write(BIO_s_socket());
+    if (BIO_get_ktls_send(bio)) {
+        // records of the kernel, written as OpenSSL does, with SIGPIPE held
+        // for this thread and discarded unless it was pending already
+        sigset_t pipe, previous, pending;
+        sigemptyset(&pipe);
+        sigaddset(&pipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe, &previous);
+        sigpending(&pending);
+        bool raised = sigismember(&pending, SIGPIPE);
+        int n = socket_write(bio, data, size);
+        int error = errno;
+        sigpending(&pending);
+        if (!raised && sigismember(&pending, SIGPIPE)) {
+            struct timespec now = {0, 0};
+            sigtimedwait(&pipe, NULL, &now);
+        }
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        errno = error;
+        return n;
+    }
+    BIO_clear_retry_flags(bio);
+    int n = send(BIO_get_fd(bio, NULL), data, size, MSG_NOSIGNAL);
+    if (n <= 0 && BIO_sock_should_retry(n)) {
+        BIO_set_retry_write(bio);
+    }
+    return n;
+}
+
+static BIO_METHOD* tls_socket_method() {
+    // the socket BIO of OpenSSL, kTLS included, but for writes
+    const BIO_METHOD* socket = BIO_s_socket();
+    BIO_METHOD* method = BIO_meth_new(BIO_TYPE_SOCKET, "httpcpp socket");
+    BIO_meth_set_write(method, tls_socket_write);
+    BIO_meth_set_read(method, BIO_meth_get_read(socket));
+    BIO_meth_set_puts(method, BIO_meth_get_puts(socket));
+    BIO_meth_set_ctrl(method, BIO_meth_get_ctrl(socket));
+    BIO_meth_set_create(method, BIO_meth_get_create(socket));
+    BIO_meth_set_destroy(method, BIO_meth_get_destroy(socket));
+    return method;
+}
+
+static bool tls_attach(SSL* const stream, const int& fd) {
+    static BIO_METHOD* method = tls_socket_method();
+    BIO* bio = BIO_new(method);
+    if (bio == NULL) {
+        return false;
+    }
+    BIO_set_fd(bio, fd, BIO_NOCLOSE);
+    SSL_set_bio(stream, bio, bio);
+    return true;
+}
+#endif
+
+static ssl_ctx_st* tls_server_context(const string& cert_file,
+    const string& key_file) {
+#ifdef HTTPCPP_TLS
+    ERR_clear_error();
+    errno = 0;
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL) {
+        throw runtime_error(tls_error());
+    }
+    if (SSL_CTX_use_certificate_chain_file(context, cert_file.data()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, key_file.data(), 
+            SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) {
+        string error = tls_error();
+        SSL_CTX_free(context);
+        throw runtime_error(error);
+    }
+    tls_configure(context);
+    // resume sessions from tickets, or from the cache for clients without
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(context, 
+        (const unsigned char*)"httpcpp", 7);
+    return context;
+#else
+    throw runtime_error("TLS is not supported, build with TLS=1");
+#endif
+}
+
+static ssl_ctx_st* tls_client_context(const string& ca_file, 
+    const bool& verify) {
+#ifdef HTTPCPP_TLS
+    ERR_clear_error();
+    errno = 0;
+    SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+    if (context == NULL) {
+        throw runtime_error(tls_error());
+    }
+    int loaded = ca_file.empty() ? 
+        SSL_CTX_set_default_verify_paths(context) :
+        SSL_CTX_load_verify_locations(context, ca_file.data(), NULL);
+    if (loaded != 1) {
+        string error = tls_error();
+        SSL_CTX_free(context);
+        throw runtime_error(error);
+    }
+    tls_configure(context);
+    SSL_CTX_set_verify(context, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE,
+        NULL);
+    // sessions are kept by the client, per host, rather than by OpenSSL
+    SSL_CTX_set_session_cache_mode(context, 
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    return context;
+#else
+    throw runtime_error("TLS is not supported, build with TLS=1");
+#endif
+}
+
+static void tls_free_context(ssl_ctx_st* const context) {
+#ifdef HTTPCPP_TLS
+    SSL_CTX_free(context);
+#endif
+}
+
+static void tls_free_session(ssl_session_st* const session) {
+#ifdef HTTPCPP_TLS
+    SSL_SESSION_free(session);
+#endif
+}
+
+static ssl_st* find_stream(map<int, ssl_st*>& streams, const int& fd) {
+    map<int, ssl_st*>::iterator it = streams.find(fd);
+    return it == streams.end() ? NULL : (*it).second;
+}
+
+static ssl_st* stream_accept(ssl_ctx_st* const context, const int& fd) {
+#ifdef HTTPCPP_TLS
+    SSL* stream = SSL_new(context);
+    if (stream != NULL && !tls_attach(stream, fd)) {
+        SSL_free(stream);
+        stream = NULL;
+    }
+    if (stream != NULL) {
+        SSL_set_accept_state(stream);
+    }
+    return stream;
+#else
+    return NULL;
+#endif
+}
+
+static ssl_st* stream_connect(ssl_ctx_st* const context, const int& fd,
+    const string& name, ssl_session_st* const session) {
+#ifdef HTTPCPP_TLS
+    SSL* stream = SSL_new(context);
+    if (stream == NULL || !tls_attach(stream, fd)) {
+        SSL_free(stream);
+        return NULL;
+    }
+    SSL_set_connect_state(stream);
+    // the certificate must match the name or the address of the server
+    if (is_address(name)) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(stream), name.data());
+    } else if (!is_unix(name)) {
+        SSL_set_tlsext_host_name(stream, name.data());
+        SSL_set1_host(stream, name.data());
+    }
+    if (session != NULL) {
+        SSL_set_session(stream, session);
+    }
+    return stream;
+#else
+    return NULL;
+#endif
+}
+
+static int stream_handshake(ssl_st* const stream, string& error) {
+    // returns 0 when done, 'r' or 'w' to wait for the socket, -1 on failure
+#ifdef HTTPCPP_TLS
+    ERR_clear_error();
+    errno = 0;
+    int n = SSL_do_handshake(stream);
+    if (n == 1) {
+        return 0;
+    }
+    switch (SSL_get_error(stream, n)) {
+        case SSL_ERROR_WANT_READ:
+            return 'r';
+        case SSL_ERROR_WANT_WRITE:
+            return 'w';
+    }
+    long verified = SSL_get_verify_result(stream);
+    if (verified != X509_V_OK) {
+        error = X509_verify_cert_error_string(verified);
+    } else {
+        error = tls_error();
+    }
+    return -1;
+#else
+    return 0;
+#endif
+}
+
+static bool stream_established(ssl_st* const stream) {
+#ifdef HTTPCPP_TLS
+    return SSL_is_init_finished(stream) == 1;
+#else
+    return true;
+#endif
+}
+
+static bool stream_offloaded(ssl_st* const stream) {
+    // true once the kernel encrypts and decrypts the records on its own
+#ifdef HTTPCPP_TLS
+    return BIO_get_ktls_send(SSL_get_wbio(stream)) &&
+        BIO_get_ktls_recv(SSL_get_rbio(stream)) && SSL_pending(stream) == 0;
+#else
+    return false;
+#endif
+}
+
+static ssize_t stream_read(ssl_st* const stream, const int& fd, 
+    char* buffer, const size_t& size) {
+#ifdef HTTPCPP_TLS
+    if (stream != NULL) {
+        ERR_clear_error();
+        errno = 0;
+        int n = SSL_read(stream, buffer, size);
+        return n > 0 ? n : tls_status(stream, n);
+    }
+#endif
+    return read(fd, buffer, size);
+}
+
+static ssize_t stream_write(ssl_st* const stream, const int& fd, 
+    const char* data, const size_t& size) {
+#ifdef HTTPCPP_TLS
+    if (stream != NULL) {
+        ERR_clear_error();
+        errno = 0;
+        int n = SSL_write(stream, data, size);
+        return n > 0 ? n : tls_status(stream, n);
+    }
+#endif
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINPROGRESS) {
+        // connecting with TCP_FASTOPEN_CONNECT, writable once connected
+        errno = EAGAIN;
+    }
+    return n;
+}
+
+static void stream_notify(ssl_st* const stream) {
+    // send close_notify, without waiting for the peer's
+#ifdef HTTPCPP_TLS
+    ERR_clear_error();
+    SSL_shutdown(stream);
+#endif
+}
+
+static ssl_session_st* stream_session(ssl_st* const stream) {
+    // returns the session if it can be resumed, which the caller must free
+    ssl_session_st* session = NULL;
+#ifdef HTTPCPP_TLS
+    session = SSL_get1_session(stream);
+    if (session != NULL && SSL_SESSION_is_resumable(session) != 1) {
+        SSL_SESSION_free(session);
+        session = NULL;
+    }
+#endif
+    return session;
+}
+
+static void stream_close(ssl_st* const stream) {
+#ifdef HTTPCPP_TLS
+    SSL_free(stream);
+#endif
+}
+
 // HttpRequest
 
 HttpRequest* HttpRequest::from_sequence(const string& sequence) {
-    size_t p0 = sequence.find("\r\n\r\n");
-    if (p0 != string::npos) {
-        p0 += 4;
-        size_t p1 = sequence.find(" ");
-        string method = sequence.substr(0, p1);
-        size_t p2 = sequence.find(" ", ++p1);
-        string path = sequence.substr(p1, p2 - p1);
-        size_t p3 = sequence.find("Content-Length:");
-        if (p3 != string::npos) {
-            p3 += 15;
-            size_t p4 = sequence.find("\r\n", p3);
-            int length = atoi(sequence.substr(p3, p4 - p3).data());
-            if (sequence.size() >= p0 + length) {
-                string body = sequence.substr(p0, length);
-                return new HttpRequest(method, path, body);
-            } 
-        } else {
-            return new HttpRequest(method, path);
-        } 
+    // the request line
+    size_t p0 = sequence.find("\r\n");
+    size_t p1 = sequence.find(" ");
+    if (p0 == string::npos || p1 == string::npos || p1 > p0) {
+        return NULL;
     }
-    return NULL;
+    size_t p2 = sequence.find(" ", p1 + 1);
+    if (p2 == string::npos || p2 > p0) {
+        return NULL;
+    }
+    HttpRequest* request = new HttpRequest(sequence.substr(0, p1),
+        sequence.substr(p1 + 1, p2 - p1 - 1));
+    request->version = sequence.substr(p2 + 1, p0 - p2 - 1);
+    // the headers, one per line until the empty line
+    for (size_t p3 = p0 + 2; p3 < sequence.size(); ) {
+        size_t p4 = sequence.find("\r\n", p3);
+        if (p4 == string::npos || p4 == p3) {
+            break;
+        }
+        size_t p5 = sequence.find(":", p3);
+        if (p5 != string::npos && p5 < p4) {
+            size_t p6 = sequence.find_first_not_of(" \t", p5 + 1);
+            size_t p7 = sequence.find_last_not_of(" \t", p4 - 1);
+            string name = to_lower(sequence.substr(p3, p5 - p3));
+            string value;
+            if (p6 < p4 && p7 >= p6) {
+                value = sequence.substr(p6, p7 - p6 + 1);
+            }
+            if (request->headers.count(name) > 0) {
+                request->headers[name] += ", " + value;
+            } else {
+                request->headers[name] = value;
+            }
+        }
+        p3 = p4 + 2;
+    }
+    // the length of the body, if any
+    if (request->headers.count("content-length") > 0) {
+        const string& value = request->headers["content-length"];
+        char* end = NULL;
+        errno = 0;
+        unsigned long length = strtoul(value.data(), &end, 10);
+        // a body that could never be held is refused up front
+        if (value.empty() || *end != '\0' || value[0] == '-' || 
+            errno == ERANGE || length > request->body.max_size()) {
+            delete request;
+            return NULL;
+        }
+        request->length = length;
+    }
+    return request;
 }
 
 HttpRequest::HttpRequest(const string& method, const string& path, 
@@ -45,6 +568,16 @@ HttpRequest::HttpRequest(const string& method, const string& path,
     this->method = method;
     this->path = path;
     this->body = body;
+    this->length = body.size();
+    this->received = 0;
+    this->handler = NULL;
+    this->server = NULL;
+    this->fd = -1;
+    this->done = false;
+    this->deferred = false;
+    this->reader = NULL;
+    this->stream = 0;
+    this->leading = false;
 }
 
 const string& HttpRequest::get_method() {
@@ -59,10 +592,29 @@ const string& HttpRequest::get_body() {
     return this->body;
 }
 
+const string& HttpRequest::get_header(const string& name) {
+    static const string none;
+    map<string, string>::const_iterator it = this->headers.find(to_lower(name));
+    return it == this->headers.end() ? none : (*it).second;
+}
+
+const map<string, string>& HttpRequest::get_headers() {
+    return this->headers;
+}
+
+const size_t& HttpRequest::get_length() {
+    return this->length;
+}
+
+const string& HttpRequest::get_version() {
+    return this->version;
+}
+
 // HttpResponse
 
-const string HttpResponse::to_sequence(int code, const string& body) {
-    stringstream packet;
+static string status_line(int code) {
+    // the status line of every response, interim ones included
+    stringstream line;
     string reason;
     switch (code) {
         case 100: reason = "Continue"; break;
@@ -106,7 +658,18 @@ const string HttpResponse::to_sequence(int code, const string& body) {
         case 505: reason = "HTTP Version Not Supported"; break;
         default: code = 500; reason = "Internal Server Error"; break;
     }
-    packet << "HTTP/1.0 " << code << " " << reason << "\r\n";
+    line << "HTTP/1.0 " << code << " " << reason << "\r\n";
+    return line.str();
+}
+
+const string HttpResponse::to_sequence(int code, const string& body,
+    const map<string, string>& headers) {
+    stringstream packet;
+    packet << status_line(code);
+    map<string, string>::const_iterator it;
+    for (it = headers.begin(); it != headers.end(); it++) {
+        packet << (*it).first << ": " << (*it).second << "\r\n";
+    }
     packet << "Content-Length: " << body.size() << "\r\n\r\n";
     packet << body;
     return packet.str();
@@ -150,10 +713,41 @@ void HttpRequestHandler::reply(HttpRequest* const request, const int& code,
     const string& body) {
     if (request->done) {
         throw runtime_error("Reply to reqeust is already done");
+    } else if (request->server == NULL) {
+        // the client of the deferred request is gone, see on_abort()
+        delete request;
     } else {
-        request->server->reply(request->fd, code, body);
         request->done = true;
+        request->server->respond(request, code, body);
+    }
+}
+
+void HttpRequestHandler::defer(HttpRequest* const request) {
+    request->deferred = true;
+}
+
+int HttpRequestHandler::detach(HttpRequest* const request, string& pending) {
+    if (request->done) {
+        throw runtime_error("Reply to reqeust is already done");
+    }
+    int fd = -1;
+    if (request->stream == 0) {
+        fd = request->server->detach(request->fd, pending);
     }
+    request->done = true;
+    if (fd < 0) {
+        // neither a stream of HTTP/2 nor a session encrypted in user space
+        // can be handed over
+        request->server->respond(request, 501, "");
+    } else if (!request->flight.empty()) {
+        // the requests waiting for this one cannot share the connection
+        request->server->land(request, 503, "");
+    }
+    return fd;
+}
+
+void HttpRequestHandler::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
 }
 
 void HttpRequestHandler::get(HttpRequest* const request,
@@ -166,6 +760,26 @@ void HttpRequestHandler::post(HttpRequest* const request,
     this->reply(request, 405);
 }
 
+void HttpRequestHandler::on_body_chunk(HttpRequest* const request,
+    const char* data, const size_t& size) {
+    if (request->body.empty()) {
+        // the announced length is the client's word, not to be trusted
+        request->body.reserve(min(request->length, (size_t)BODY_RESERVE));
+    }
+    request->body.append(data, size);
+}
+
+void HttpRequestHandler::on_body_end(HttpRequest* const request,
+    const vector<string>& args) {
+    if (request->method.compare("GET") == 0) {
+        this->get(request, args);
+    } else if (request->method.compare("POST") == 0) {
+        this->post(request, args);
+    } else {
+        this->reply(request, 405);
+    }
+}
+
 // IOHandler
 
 void IOHandler::clear_buffers(const int& fd) {
@@ -173,361 +787,5120 @@ void IOHandler::clear_buffers(const int& fd) {
     this->write_buffers.erase(fd);
 }
 
-// AsyncHttpClient
+// DnsResolver
 
-void AsyncHttpClient::on_read(const int& fd) {
-    char buffer[BUFFER_SIZE];
-    bool done = false;
-    bool error = false;
-    while (true) {
-        ssize_t n = read(fd, buffer, BUFFER_SIZE);
-        if (n > 0) { 
-            this->read_buffers[fd].append(buffer, n);
-        } else if (n == 0) { 
-            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
-            HttpResponse* response = 
-                HttpResponse::from_sequence(this->read_buffers[fd]);
-            if (response != NULL) {
-                this->handlers[fd]->handle(response);
-                delete response;
-            } else {
-                error = true;
+/**
+ * DnsQuery keeps the state of the A and AAAA queries of a host and retries
+ * them when the nameserver does not answer in time.
+ */
+class DnsQuery : public TimeoutHandler {
+    public:
+        DnsResolver* resolver;
+        string host;
+        vector<DnsHandler*> handlers;
+        int fd;
+        int timeout;
+        int attempt;
+        unsigned short ids[2];
+        bool answered[2];
+        bool missing;
+        vector<string> addresses;
+        size_t ipv4;
+        long long ttl;
+        long long negative_ttl;
+        void on_timeout() {
+            this->timeout = -1;
+            this->resolver->send_query(this);
+        }
+};
+
+/**
+ * DnsSearch tries the names left of a host, made with the search domains, in
+ * turn until one of them is found.
+ */
+class DnsSearch : public DnsHandler {
+    public:
+        DnsResolver* resolver;
+        vector<string> names;
+        DnsHandler* handler;
+        DnsSearch(DnsResolver* const resolver, const vector<string>& names,
+            DnsHandler* const handler) {
+            this->resolver = resolver;
+            this->names = names;
+            this->handler = handler;
+        }
+        ~DnsSearch() {
+            delete this->handler;
+        }
+        void handle(const vector<string>& addresses) {
+            this->handler->handle(addresses);
+        }
+        void handle_error(const string& error) {
+            if (this->names.empty() || error.compare("Host not found") != 0) {
+                this->handler->handle_error(error);
+                return;
             }
-            done = true;
-            // delete the handler to de-allocate the memory
-            delete this->handlers[fd];
-            break;
-        } else {
-            if (errno == EAGAIN) {
-                // try again later
-            } else {
-                done = true;
-            } 
-            break;
+            // this is deleted when it returns, the handler goes on
+            vector<string> rest(this->names.begin() + 1, this->names.end());
+            DnsSearch* next = new DnsSearch(this->resolver, rest, 
+                this->handler);
+            this->handler = NULL;
+            this->resolver->lookup(this->names[0], next);
         }
+};
+
+static string dns_question(const unsigned short& id, const string& host,
+    const unsigned short& type) {
+    string packet;
+    // header: id, recursion desired, one question
+    packet += (char)(id >> 8);
+    packet += (char)(id & 0xff);
+    packet.append("\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+    // question: the labels of the name, the type and the class IN
+    size_t p0 = 0;
+    while (p0 < host.size()) {
+        size_t p1 = host.find('.', p0);
+        if (p1 == string::npos) {
+            p1 = host.size();
+        }
+        packet += (char)(p1 - p0);
+        packet.append(host, p0, p1 - p0);
+        p0 = p1 + 1;
     }
-    if (done) {
-        this->on_close(fd);
-    }
-    if (error) {
-        throw runtime_error("AsyncHttpClient read error");
-    }
+    packet += '\0';
+    packet += (char)(type >> 8);
+    packet += (char)(type & 0xff);
+    packet.append("\x00\x01", 2);
+    return packet;
 }
 
-void AsyncHttpClient::on_write(const int& fd) {
-    bool error = false;
-    int n_is_zero = 0;
-    while (true) {
-        size_t size = this->write_buffers[fd].size();
-        ssize_t n = write(fd, this->write_buffers[fd].data(), size);
-        if (n > 0) {
-            this->write_buffers[fd].erase(0, n);
-        } else if (n == 0) {
-            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
-            n_is_zero++;
-            if (this->write_buffers[fd].size() == 0) {
-                // prepare the read buffer
-                this->clear_buffers(fd);
-                this->read_buffers[fd] = string();
-                this->loop->set_handler(fd, this);
-                break;
-            } else {
-                if (n_is_zero == 3) {
-                    error = true;
-                    break;
-                }
-            } 
-        } else {
-            if (errno == EAGAIN) {
-                // try again later
-            } else {
-                error = true;
-            }
-            break;
+static size_t dns_skip_name(const unsigned char* data, const size_t& size,
+    size_t p) {
+    while (p < size) {
+        if ((data[p] & 0xc0) == 0xc0) {
+            return p + 2;
+        } else if (data[p] == 0) {
+            return p + 1;
         }
+        p += data[p] + 1;
     }
-    if (error) {
-        this->on_close(fd);
-    }
+    return size + 1;
 }
 
-void AsyncHttpClient::on_close(const int& fd) {
-    this->clear_buffers(fd);
-    this->handlers.erase(fd);
-    close(fd);
+static unsigned long dns_read32(const unsigned char* data) {
+    return ((unsigned long)data[0] << 24) | (data[1] << 16) | 
+        (data[2] << 8) | data[3];
 }
 
-AsyncHttpClient::AsyncHttpClient(IOLoop* const loop) {
-    // set the IO loop
-    if (loop == NULL) {
-        this->loop = IOLoop::instance();
-    } else {
-        this->loop = loop;
-    }
+vector<string> DnsResolver::rotate(const string& name) {
+    vector<string>& addresses = this->records[name];
+    size_t cursor = this->cursors[name]++ % addresses.size();
+    vector<string> rotated(addresses.begin() + cursor, addresses.end());
+    rotated.insert(rotated.end(), addresses.begin(), 
+        addresses.begin() + cursor);
+    return rotated;
 }
 
-void AsyncHttpClient::fetch(const string& host, const int& port, 
-    const string& method, const string& path, const string& body, 
-    HttpResponseHandler* const handler) {
-    int fd;
-    struct sockaddr_in addr;
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        throw runtime_error(strerror(errno));
+void DnsResolver::send_query(DnsQuery* const query) {
+    if (query->fd >= 0) {
+        this->sockets.erase(query->fd);
+        this->loop->unset_handler(query->fd);
+        close(query->fd);
+        query->fd = -1;
     }
+    if (query->attempt >= DNS_ATTEMPTS || this->nameservers.empty()) {
+        this->complete(query, "DNS timeout");
+        return;
+    }
+    // each attempt goes to the next nameserver on a fresh socket
+    pair<string, int> nameserver = 
+        this->nameservers[query->attempt++ % this->nameservers.size()];
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
     memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_aton(host.data(), &addr.sin_addr) <= 0) {
-        close(fd);
-        throw runtime_error(strerror(errno));
+    if (nameserver.first.find(':') == string::npos) {
+        struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(nameserver.second);
+        inet_pton(AF_INET, nameserver.first.data(), &in->sin_addr);
+        addr_len = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(nameserver.second);
+        inet_pton(AF_INET6, nameserver.first.data(), &in6->sin6_addr);
+        addr_len = sizeof(struct sockaddr_in6);
     }
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        throw runtime_error(strerror(errno));
+    int fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, addr_len) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        this->send_query(query);
+        return;
     }
-    stringstream packet;
-    packet << method << " " << path << " HTTP/1.0\r\n" <<
-        "Content-Length: " << body.size() << "\r\n\r\n" << body;
-    // set the write buffer and the handler.
-    this->clear_buffers(fd);
-    this->write_buffers[fd] = packet.str();
-    this->handlers[fd] = handler;
-    this->loop->set_handler(fd, this, 'w');
+    query->fd = fd;
+    this->sockets[fd] = query;
+    this->loop->set_handler(fd, this);
+    for (int i = 0; i < 2; i++) {
+        if (!query->answered[i]) {
+            query->ids[i] = next_random(this->seed) & 0xffff;
+            string packet = dns_question(query->ids[i], query->host, 
+                i == 0 ? 1 : 28);
+            send(fd, packet.data(), packet.size(), MSG_DONTWAIT);
+        }
+    }
+    query->timeout = this->loop->add_timeout(DNS_TIMEOUT, query);
 }
 
-// AsyncHttpServer
-
-HttpRequestHandler* AsyncHttpServer::find_handler(const string& path) {
-    vector<pair<string, HttpRequestHandler*> >::iterator it;
-    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
-        regex_t preg;
-        if (regcomp(&preg, (*it).first.data(), REG_EXTENDED | REG_NOSUB) == 0) {
-            if (regexec(&preg, path.data(), 0, NULL, 0) == 0) {
-                regfree(&preg);
-                return (*it).second;
-            }
-            regfree(&preg);
+void DnsResolver::complete(DnsQuery* const query, const string& error) {
+    // cache the outcome, unless the nameservers could not be reached
+    string failure = error;
+    if (!query->addresses.empty()) {
+        // e.g. the A answer came and the AAAA one timed out
+        failure.clear();
+        this->records[query->host] = query->addresses;
+        this->expiries[query->host] = IOLoop::now() + query->ttl * 1000;
+    } else if (failure.empty()) {
+        failure = "Host not found";
+        this->records[query->host] = vector<string>();
+        this->expiries[query->host] = IOLoop::now() + 
+            (query->negative_ttl >= 0 ? query->negative_ttl : 
+             this->negative_ttl) * 1000;
+    }
+    if (query->timeout >= 0) {
+        this->loop->remove_timeout(query->timeout);
+    }
+    if (query->fd >= 0) {
+        this->sockets.erase(query->fd);
+        this->loop->unset_handler(query->fd);
+        close(query->fd);
+    }
+    this->queries.erase(query->host);
+    for (size_t i = 0; i < query->handlers.size(); i++) {
+        if (failure.empty()) {
+            query->handlers[i]->handle(this->rotate(query->host));
+        } else {
+            query->handlers[i]->handle_error(failure);
         }
+        delete query->handlers[i];
     }
-    return NULL;
+    delete query;
 }
 
-vector<string> AsyncHttpServer::get_arguments(const string& path) {
-    vector<string> args;
-    vector<pair<string, HttpRequestHandler*> >::iterator it;
-    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
-        regex_t preg;
-        if (regcomp(&preg, (*it).first.data(), REG_EXTENDED) == 0) {
-            size_t nmatch = MAX_NMATCH;
-            regmatch_t pmatch[nmatch];
-            if (regexec(&preg, path.data(), nmatch, pmatch, 0) == 0) {
-                for (int i = 1; i < nmatch; i++) {
-                    if (pmatch[i].rm_so == -1) {
-                        break;
-                    }
-                    int n = pmatch[i].rm_eo - pmatch[i].rm_so;
-                    args.push_back(string(path.data() + pmatch[i].rm_so, n));
-                }
-                regfree(&preg);
+void DnsResolver::on_read(const int& fd) {
+    unsigned char data[BUFFER_SIZE];
+    while (this->sockets.count(fd) > 0) {
+        ssize_t size = recv(fd, data, BUFFER_SIZE, 0);
+        if (size < 0) {
+            if (errno != EAGAIN) {
+                this->on_close(fd);
+            }
+            return;
+        }
+        DnsQuery* query = this->sockets[fd];
+        unsigned short id = (data[0] << 8) | data[1];
+        int i = id == query->ids[0] ? 0 : (id == query->ids[1] ? 1 : -1);
+        if (size < 12 || (data[2] & 0x80) == 0 || i < 0 || 
+            query->answered[i]) {
+            continue;
+        }
+        int rcode = data[3] & 0x0f;
+        if (rcode != 0 && rcode != 3) {
+            // the nameserver failed, try the next one
+            this->send_query(query);
+            return;
+        }
+        query->answered[i] = true;
+        size_t qdcount = (data[4] << 8) | data[5];
+        size_t ancount = (data[6] << 8) | data[7];
+        size_t nscount = (data[8] << 8) | data[9];
+        size_t p = 12;
+        for (size_t j = 0; j < qdcount; j++) {
+            p = dns_skip_name(data, size, p) + 4;
+        }
+        // A and AAAA records of the answers, following CNAMEs implicitly, and
+        // the SOA of the authority that bounds the negative TTL
+        for (size_t j = 0; j < ancount + nscount && p < (size_t)size; j++) {
+            p = dns_skip_name(data, size, p);
+            if (p + 10 > (size_t)size) {
                 break;
             }
-            regfree(&preg);
+            unsigned short type = (data[p] << 8) | data[p + 1];
+            long long ttl = dns_read32(data + p + 4);
+            size_t length = (data[p + 8] << 8) | data[p + 9];
+            p += 10;
+            if (p + length > (size_t)size) {
+                break;
+            }
+            char text[INET6_ADDRSTRLEN];
+            if (j < ancount && (type == 1 || type == 28) &&
+                inet_ntop(type == 1 ? AF_INET : AF_INET6, data + p, text,
+                    sizeof(text)) != NULL && length == (type == 1 ? 4 : 16)) {
+                // IPv4 first whatever the order of the answers
+                if (type == 1) {
+                    query->addresses.insert(query->addresses.begin() + 
+                        query->ipv4++, text);
+                } else {
+                    query->addresses.push_back(text);
+                }
+                query->ttl = min(query->ttl, ttl);
+            } else if (j >= ancount && type == 6 && length >= 20) {
+                long long minimum = dns_read32(data + p + length - 4);
+                query->negative_ttl = min(ttl, minimum);
+            }
+            p += length;
+        }
+        if (query->answered[0] && query->answered[1]) {
+            this->complete(query);
+            return;
         }
     }
-    return args;
 }
 
-void AsyncHttpServer::reply(const int& fd, const int& code, 
-    const string& body) {
-    this->clear_buffers(fd);
-    this->write_buffers[fd] = HttpResponse::to_sequence(code, body);
+void DnsResolver::on_write(const int& fd) {
 }
 
-void AsyncHttpServer::on_read(const int& fd) {
-    if (fd == this->fd) {   
-        // read on listening socket, keep accepting
-        while (true) {
-            struct sockaddr_in addr;
-            socklen_t addr_len = sizeof(addr);
-            int cfd = accept(fd, (struct sockaddr*)&addr, &addr_len);
-            if (cfd < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;  
-                } else {
-                    throw runtime_error(strerror(errno));
+void DnsResolver::on_close(const int& fd) {
+    if (this->sockets.count(fd) > 0) {
+        this->send_query(this->sockets[fd]);
+    } else {
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+DnsResolver::DnsResolver(IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    this->negative_ttl = DNS_NEGATIVE_TTL;
+    this->seed = random_seed();
+    this->ndots = 1;
+    // read the nameservers, the search domains and ndots
+    ifstream conf(RESOLV_CONF);
+    string line;
+    while (getline(conf, line)) {
+        stringstream tokens(line);
+        string keyword, value;
+        if (!(tokens >> keyword >> value)) {
+            continue;
+        }
+        if (keyword.compare("nameserver") == 0 && is_address(value)) {
+            this->nameservers.push_back(make_pair(value, DNS_PORT));
+        } else if (keyword.compare("search") == 0 || 
+            keyword.compare("domain") == 0) {
+            // the last of them wins
+            this->search.clear();
+            do {
+                this->search.push_back(to_lower(value));
+            } while (keyword.compare("search") == 0 && tokens >> value);
+        } else if (keyword.compare("options") == 0) {
+            do {
+                if (value.compare(0, 6, "ndots:") == 0) {
+                    this->ndots = min(atoi(value.data() + 6), 15);
                 }
+            } while (tokens >> value);
+        }
+    }
+    this->load_hosts(HOSTS_FILE);
+}
+
+DnsResolver::~DnsResolver() {
+    // no handler of the loop is left pointing here
+    while (!this->queries.empty()) {
+        this->complete((*this->queries.begin()).second, "Cancelled");
+    }
+}
+
+void DnsResolver::resolve(const string& host, DnsHandler* const handler) {
+    string name = to_lower(host);
+    if (!name.empty() && name[name.size() - 1] == '.') {
+        name.erase(name.size() - 1);
+    }
+    if (is_address(name)) {
+        handler->handle(vector<string>(1, name));
+        delete handler;
+        return;
+    }
+    if (this->hosts.count(name) > 0) {
+        handler->handle(this->hosts[name]);
+        delete handler;
+        return;
+    }
+    // names with fewer dots than ndots are tried with the search domains
+    // first, the others as they are first, and names ending with a dot only
+    // as they are
+    vector<string> names;
+    if (host.empty() || host[host.size() - 1] != '.') {
+        for (size_t i = 0; i < this->search.size(); i++) {
+            names.push_back(name + "." + this->search[i]);
+        }
+    }
+    if (count(name.begin(), name.end(), '.') >= this->ndots) {
+        names.insert(names.begin(), name);
+    } else {
+        names.push_back(name);
+    }
+    if (names.size() == 1) {
+        this->lookup(name, handler);
+        return;
+    }
+    vector<string> rest(names.begin() + 1, names.end());
+    this->lookup(names[0], new DnsSearch(this, rest, handler));
+}
+
+void DnsResolver::lookup(const string& name, DnsHandler* const handler) {
+    if (this->expiries.count(name) > 0) {
+        if (this->expiries[name] > IOLoop::now()) {
+            if (this->records[name].empty()) {
+                handler->handle_error("Host not found");
             } else {
-                // prepare the read buffer for the accepted socket
-                this->clear_buffers(fd);
-                this->read_buffers[fd] = string();
-                this->loop->set_handler(cfd, this);
+                handler->handle(this->rotate(name));
             }
+            delete handler;
+            return;
         }
+        this->expiries.erase(name);
+        this->records.erase(name);
+    }
+    // join the query in flight, if any
+    if (this->queries.count(name) > 0) {
+        this->queries[name]->handlers.push_back(handler);
+        return;
+    }
+    DnsQuery* query = new DnsQuery();
+    query->resolver = this;
+    query->host = name;
+    query->handlers.push_back(handler);
+    query->fd = -1;
+    query->timeout = -1;
+    query->attempt = 0;
+    query->answered[0] = query->answered[1] = false;
+    query->ipv4 = 0;
+    query->ttl = 0x7fffffff;
+    query->negative_ttl = -1;
+    this->queries[name] = query;
+    this->send_query(query);
+}
 
-    } else {                
-        // read on existing socket, keep reading until EAGAIN
-        char buffer[BUFFER_SIZE];
-        bool error = false;
-        while (true) {
-            ssize_t n = read(fd, buffer, BUFFER_SIZE);
-            if (n > 0) {            
-                this->read_buffers[fd].append(buffer, n);
-            } else if (n == 0) {    
-                // socket close 
-                error = true;
-                break;
-            } else { 
-                if (errno != EAGAIN) {
-                    error = true;
-                } else {
-                    // no more data, try if request is available
-                    HttpRequest* request = 
-                        HttpRequest::from_sequence(this->read_buffers[fd]);
-                    if (request != NULL) {
-                        // find a handler to handle the request
-                        HttpRequestHandler* handler = 
-                            this->find_handler(request->path);
-                        if (handler != NULL) {
-                            vector<string> args = 
-                                this->get_arguments(request->path);
-                            request->server = this;
-                            request->fd = fd;
-                            request->done = false;
-                            if (request->method.compare("GET") == 0) {
-                                handler->get(request, args);
-                            } else if (request->method.compare("POST") == 0) {
-                                handler->post(request, args);
-                            } else {
-                                handler->reply(request, 405);
-                            }
-                        } else {
-                            this->reply(fd, 404);
-                        }
-                        if (!request->done) {
-                            this->reply(fd, 500);
-                        }
-                        delete request;
-                        this->loop->set_handler(fd, this, 'w'); 
-                        break;
-                    }
-                }
-                break;
+void DnsResolver::set_nameserver(const string& address, const int& port) {
+    this->nameservers.clear();
+    this->nameservers.push_back(make_pair(address, port));
+}
+
+void DnsResolver::load_hosts(const string& path) {
+    this->hosts.clear();
+    ifstream file(path.data());
+    string line;
+    while (getline(file, line)) {
+        stringstream tokens(line.substr(0, line.find('#')));
+        string address, name;
+        if (tokens >> address && is_address(address)) {
+            while (tokens >> name) {
+                this->hosts[to_lower(name)].push_back(address);
             }
         }
-        if (error) {
-            this->on_close(fd);
+    }
+}
+
+void DnsResolver::set_negative_ttl(const int& seconds) {
+    this->negative_ttl = seconds;
+}
+
+void DnsResolver::clear_cache() {
+    this->records.clear();
+    this->expiries.clear();
+    this->cursors.clear();
+}
+
+// HttpClientRequest
+
+HttpClientRequest::HttpClientRequest(const string& host, const int& port,
+    const string& method, const string& path, const string& body) {
+    this->host = host;
+    this->port = port;
+    this->method = method;
+    this->path = path;
+    this->body = body;
+}
+
+// HttpRetryPolicy
+
+HttpRetryPolicy::HttpRetryPolicy(const int& attempts, const int& backoff,
+    const int& max_backoff, const int& hedge_delay, 
+    const double& hedge_percentile) {
+    this->attempts = attempts;
+    this->backoff = backoff;
+    this->max_backoff = max_backoff;
+    this->hedge_delay = hedge_delay;
+    this->hedge_percentile = hedge_percentile;
+}
+
+// SocketOptions
+
+SocketOptions::SocketOptions() {
+    this->nodelay = false;
+    this->defer_accept = 0;
+    this->fastopen = 0;
+    this->quickack = false;
+    this->send_buffer = 0;
+    this->receive_buffer = 0;
+    this->keepalive_idle = 0;
+    this->keepalive_interval = 0;
+    this->keepalive_count = 0;
+    this->cork = false;
+}
+
+// HttpBatch
+
+/**
+ * HttpBatch keeps the state of a batch of requests made with
+ * AsyncHttpClient::fetch_all() and expires it at its deadline.
+ */
+class HttpBatch : public TimeoutHandler {
+    public:
+        enum State { PENDING, RUNNING, DONE };
+        AsyncHttpClient* client;
+        HttpBatchHandler* handler;
+        vector<HttpClientRequest> requests;
+        vector<HttpResponse*> responses;
+        vector<string> errors;
+        vector<State> states;
+        vector<int> ids;
+        int concurrency;
+        int running;
+        int remaining;
+        int timeout;
+        bool expired;
+        void on_timeout() {
+            this->client->expire(this);
+        }
+};
+
+/**
+ * HttpBatchMember passes the outcome of one request of a batch to the batch.
+ */
+class HttpBatchMember : public HttpResponseHandler {
+    public:
+        HttpBatch* batch;
+        int index;
+        HttpBatchMember(HttpBatch* const batch, const int& index) {
+            this->batch = batch;
+            this->index = index;
+        }
+        void handle(HttpResponse* const response) {
+            this->batch->client->record(this->batch, this->index, response);
+        }
+        void handle_error(const string& error) {
+            this->batch->client->record(this->batch, this->index, NULL, error);
+        }
+};
+
+/**
+ * HttpRetry keeps the state of a fetch made under an HttpRetryPolicy, whose
+ * timeout is either the backoff of the next retry or the hedge of the request
+ * in flight.
+ */
+class HttpRetry : public TimeoutHandler {
+    public:
+        AsyncHttpClient* client;
+        int id;
+        HttpClientRequest request;
+        HttpRetryPolicy policy;
+        HttpResponseHandler* handler;
+        vector<int> ids;
+        vector<string> keys;
+        vector<long long> starts;
+        vector<bool> finished;
+        int running;
+        int timeout;
+        bool launching;
+        bool done;
+        HttpResponse* response;
+        string error;
+        HttpRetry(AsyncHttpClient* const client, const int& id,
+            const HttpClientRequest& request, const HttpRetryPolicy& policy,
+            HttpResponseHandler* const handler) : request(request), 
+            policy(policy) {
+            this->client = client;
+            this->id = id;
+            this->handler = handler;
+            this->running = 0;
+            this->timeout = -1;
+            this->launching = false;
+            this->done = false;
+            this->response = NULL;
+        }
+        ~HttpRetry() {
+            delete this->response;
         }
+        void on_timeout() {
+            this->client->resume(this);
+        }
+};
+
+/**
+ * HttpRetryAttempt passes the outcome of one request of a fetch under a
+ * policy to the fetch.
+ */
+class HttpRetryAttempt : public HttpResponseHandler {
+    public:
+        HttpRetry* retry;
+        int index;
+        HttpRetryAttempt(HttpRetry* const retry, const int& index) {
+            this->retry = retry;
+            this->index = index;
+        }
+        void handle(HttpResponse* const response) {
+            this->retry->client->settle(this->retry, this->index, response);
+        }
+        void handle_error(const string& error) {
+            this->retry->client->settle(this->retry, this->index, NULL, 
+                error);
+        }
+};
+
+/**
+ * HttpResolution keeps a fetch whose host is being resolved.
+ */
+class HttpResolution : public DnsHandler {
+    public:
+        AsyncHttpClient* client;
+        int id;
+        int port;
+        string packet;
+        HttpResponseHandler* handler;
+        HttpResolution(AsyncHttpClient* const client, const int& id, 
+            const int& port, const string& packet, 
+            HttpResponseHandler* const handler) {
+            this->client = client;
+            this->id = id;
+            this->port = port;
+            this->packet = packet;
+            this->handler = handler;
+        }
+        void handle(const vector<string>& addresses) {
+            if (this->client != NULL) {
+                this->client->resolved(this, addresses);
+            }
+        }
+        void handle_error(const string& error) {
+            if (this->client != NULL) {
+                this->client->resolved(this, vector<string>(), error);
+            }
+        }
+};
+
+/**
+ * HttpFallback keeps what a fetch needs to connect to the next addresses of
+ * its host while the connection to the current one is pending.
+ */
+class HttpFallback {
+    public:
+        int id;
+        int port;
+        string packet;
+        string tls_name;
+        vector<string> addresses;
+};
+
+// Http2Connection
+
+static const char* const H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// the static table of HPACK, indexed from 1
+static const char* const HPACK_STATIC[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+    {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""}
+};
+
+// the Huffman code of HPACK, as the code and its length in bits per symbol
+static const unsigned int HPACK_HUFFMAN[256][2] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6},
+    {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12},
+    {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7},
+    {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7},
+    {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7},
+    {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7},
+    {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19},
+    {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6},
+    {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7},
+    {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11},
+    {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20},
+    {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}
+};
+
+static vector<int> huffman_tree() {
+    // pairs of children per node, the root first; a negative child is the
+    // leaf of the symbol minus one and 0 is no child
+    vector<int> tree(2, 0);
+    for (int symbol = 0; symbol < 256; symbol++) {
+        unsigned int code = HPACK_HUFFMAN[symbol][0];
+        int node = 0;
+        for (int i = HPACK_HUFFMAN[symbol][1] - 1; i > 0; i--) {
+            int bit = (code >> i) & 1;
+            if (tree[2 * node + bit] == 0) {
+                tree[2 * node + bit] = tree.size() / 2;
+                tree.resize(tree.size() + 2, 0);
+            }
+            node = tree[2 * node + bit];
+        }
+        tree[2 * node + (code & 1)] = -(symbol + 1);
     }
+    return tree;
 }
 
-void AsyncHttpServer::on_write(const int& fd) {
-    bool done = false;
-    bool error = false;
-    int n_is_zero = 0;
-    while (true) {
-        size_t size = this->write_buffers[fd].size();
-        ssize_t n = write(fd, this->write_buffers[fd].data(), size);
-        if (n > 0) {
-            this->write_buffers[fd].erase(0, n); 
-        } else if (n == 0) {
-            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
-            n_is_zero++;
-            if (this->write_buffers[fd].size() == 0) {
-                done = true;
-                break;
+static bool huffman_decode(const char* data, const size_t& size, 
+    string& text) {
+    static const vector<int> tree = huffman_tree();
+    int node = 0;
+    int depth = 0;
+    bool ones = true;
+    for (size_t i = 0; i < size; i++) {
+        for (int shift = 7; shift >= 0; shift--) {
+            int bit = (data[i] >> shift) & 1;
+            int next = tree[2 * node + bit];
+            if (next < 0) {
+                text += (char)(-next - 1);
+                node = 0;
+                depth = 0;
+                ones = true;
+            } else if (next == 0) {
+                return false;
             } else {
-                if (n_is_zero == 3) {
-                    error = true;
-                    break;
-                }
+                node = next;
+                depth++;
+                ones = ones && bit == 1;
             }
+        }
+    }
+    // the padding is the beginning of the code of EOS, i.e. up to 7 ones
+    return depth < 8 && ones;
+}
+
+static void hpack_integer(string& block, const int& first, const int& prefix,
+    size_t value) {
+    size_t max = (1 << prefix) - 1;
+    if (value < max) {
+        block += (char)(first | value);
+        return;
+    }
+    block += (char)(first | max);
+    for (value -= max; value >= 128; value /= 128) {
+        block += (char)(value % 128 + 128);
+    }
+    block += (char)value;
+}
+
+static bool hpack_read_integer(const string& block, size_t& pos, 
+    const int& prefix, size_t& value) {
+    if (pos >= block.size()) {
+        return false;
+    }
+    size_t max = (1 << prefix) - 1;
+    value = (unsigned char)block[pos++] & max;
+    for (int shift = 0; value >= max; shift += 7) {
+        if (pos >= block.size() || shift > 28) {
+            return false;
+        }
+        unsigned char byte = block[pos++];
+        value += (size_t)(byte & 127) << shift;
+        if ((byte & 128) == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+static bool hpack_read_string(const string& block, size_t& pos, 
+    string& text) {
+    if (pos >= block.size()) {
+        return false;
+    }
+    bool huffman = (block[pos] & 0x80) != 0;
+    size_t size = 0;
+    if (!hpack_read_integer(block, pos, 7, size) || 
+        size > block.size() - pos) {
+        return false;
+    }
+    text.clear();
+    if (huffman) {
+        if (!huffman_decode(block.data() + pos, size, text)) {
+            return false;
+        }
+    } else {
+        text.assign(block, pos, size);
+    }
+    pos += size;
+    return true;
+}
+
+static void hpack_field(string& block, const int& index, const string& value) {
+    // literal without indexing, named by the static table and not encoded
+    // with Huffman, so that the tables of the peer never change
+    hpack_integer(block, 0x00, 4, index);
+    hpack_integer(block, 0x00, 7, value.size());
+    block += value;
+}
+
+static string h2_u32(const unsigned long& value) {
+    string bytes(4, '\0');
+    bytes[0] = (value >> 24) & 0xff;
+    bytes[1] = (value >> 16) & 0xff;
+    bytes[2] = (value >> 8) & 0xff;
+    bytes[3] = value & 0xff;
+    return bytes;
+}
+
+static bool h2_settings(const string& header, string& payload) {
+    // the payload of a SETTINGS frame in base64url, padding optional
+    unsigned long bits = 0;
+    int count = 0;
+    payload.clear();
+    size_t end = header.find_last_not_of('=');
+    end = end == string::npos ? 0 : end + 1;
+    for (size_t i = 0; i < end; i++) {
+        char c = header[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
         } else {
-            if (errno == EAGAIN) {
-                // try again later
-            } else {
-                error = true;
+            return false;
+        }
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            payload += (char)((bits >> count) & 0xff);
+        }
+    }
+    return count < 6 && payload.size() % 6 == 0;
+}
+
+static unsigned long h2_read32(const string& bytes, const size_t& pos) {
+    const unsigned char* data = (const unsigned char*)bytes.data() + pos;
+    return (unsigned long)data[0] << 24 | data[1] << 16 | data[2] << 8 | 
+        data[3];
+}
+
+/**
+ * Http2Stream keeps the state of one stream of an HTTP/2 connection.
+ */
+class Http2Stream {
+    public:
+        int id;
+        long long window;
+        string pending;
+        size_t sent;
+        bool ending;
+        bool closed;
+        // the server side
+        HttpRequest* request;
+        bool traced;
+        string pattern;
+        // the client side
+        int fetch;
+        HttpResponseHandler* handler;
+        string block;
+        int code;
+        string body;
+        Http2Stream(const int& id, const long long& window) {
+            this->id = id;
+            this->window = window;
+            this->sent = 0;
+            this->ending = false;
+            this->closed = false;
+            this->request = NULL;
+            this->traced = false;
+            this->fetch = 0;
+            this->handler = NULL;
+            this->code = 0;
+        }
+};
+
+/**
+ * Http2Connection speaks HTTP/2 over a connection of AsyncHttpServer, where
+ * streams become requests to the handlers, or of AsyncHttpClient, where
+ * fetches to the same host become streams. Data received is consumed right
+ * away, so the windows given to the peer are opened again at once, while
+ * data sent waits for the windows given by the peer.
+ */
+class Http2Connection {
+    public:
+        enum Type { DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, 
+            SETTINGS = 0x4, PUSH_PROMISE = 0x5, PING = 0x6, GOAWAY = 0x7, 
+            WINDOW_UPDATE = 0x8, CONTINUATION = 0x9 };
+        enum Flag { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, 
+            PADDED = 0x8, PRIORITY = 0x20 };
+        enum Error { NONE = 0x0, PROTOCOL = 0x1, FLOW_CONTROL = 0x3, 
+            FRAME_SIZE = 0x6, REFUSED = 0x7, CANCEL = 0x8, COMPRESSION = 0x9 };
+        enum Event { HEAD, PIECE, END };
+        AsyncHttpServer* server;
+        AsyncHttpClient* client;
+        string key;
+        string authority;
+        int fd;
+        ssl_st* tls;
+        string input;
+        string output;
+        bool preface;
+        bool connected;
+        bool going;
+        bool closing;
+        deque<pair<string, string> > table;
+        size_t table_size;
+        size_t table_max;
+        map<int, Http2Stream*> streams;
+        list<Http2Stream*> waiting;
+        int last_stream;
+        int header_stream;
+        int header_flags;
+        string header_block;
+        long long window;
+        long long initial_window;
+        size_t max_frame;
+        size_t max_streams;
+        HttpRequest* dispatching;
+        // the client side, the addresses left to try until connected
+        int port;
+        vector<string> fallbacks;
+        Http2Connection(AsyncHttpServer* const server, const int& fd, 
+            ssl_st* const tls);
+        Http2Connection(AsyncHttpClient* const client, const string& key,
+            const string& authority);
+        ~Http2Connection();
+        void init();
+        void start();
+        bool consume(const char* data, const size_t& size);
+        bool flush();
+        void frame(const int& type, const int& flags, const int& id,
+            const char* payload, const size_t& size);
+        void fail(const int& error);
+        void process(const int& type, const int& flags, const int& id,
+            const string& payload);
+        void configure(const string& payload);
+        void end_headers();
+        bool decode(const string& block, vector<pair<string, string> >& fields);
+        void insert(const string& name, const string& value);
+        Http2Stream* find(const int& id);
+        void send_headers(const int& id, const string& block, const bool& end);
+        void send_data(Http2Stream* stream);
+        void send_all();
+        void receive_data(const int& flags, const int& id, 
+            const string& payload);
+        // the server side
+        void receive_request(const int& id, const bool& end,
+            const vector<pair<string, string> >& fields);
+        void serve(const int& id, HttpRequest* const request, const bool& end);
+        void deliver(Http2Stream* stream, const char* data, const size_t& size,
+            const bool& end);
+        void notify(Http2Stream* const stream, const int& event, 
+            const char* data=NULL, const size_t& size=0);
+        void respond(HttpRequest* const request, const int& code, 
+            const string& body);
+        void send_response(Http2Stream* const stream, const int& code,
+            const string& body);
+        void close_stream(Http2Stream* const stream, const int& error=-1);
+        // the client side
+        void attach(const int& fd);
+        void submit(const int& fetch, HttpResponseHandler* const handler,
+            const string& method, const string& path, const string& body);
+        void activate();
+        void receive_response(const int& id, const bool& end,
+            const vector<pair<string, string> >& fields);
+        void finish(Http2Stream* const stream, const string& error="");
+        void cancel(const int& fetch);
+        void abandon(const string& error);
+};
+
+Http2Connection::Http2Connection(AsyncHttpServer* const server, 
+    const int& fd, ssl_st* const tls) {
+    this->init();
+    this->server = server;
+    this->fd = fd;
+    this->tls = tls;
+    this->connected = true;
+}
+
+Http2Connection::Http2Connection(AsyncHttpClient* const client, 
+    const string& key, const string& authority) {
+    this->init();
+    this->client = client;
+    this->key = key;
+    this->authority = authority;
+    // the client speaks first, the server may not tell its limit at once
+    this->preface = true;
+    this->max_streams = H2_MAX_STREAMS;
+}
+
+Http2Connection::~Http2Connection() {
+    map<int, Http2Stream*>::iterator it;
+    for (it = this->streams.begin(); it != this->streams.end(); it++) {
+        delete (*it).second->request;
+        delete (*it).second;
+    }
+    list<Http2Stream*>::iterator it2;
+    for (it2 = this->waiting.begin(); it2 != this->waiting.end(); it2++) {
+        delete *it2;
+    }
+}
+
+void Http2Connection::init() {
+    this->server = NULL;
+    this->client = NULL;
+    this->fd = -1;
+    this->port = 0;
+    this->tls = NULL;
+    this->preface = false;
+    this->connected = false;
+    this->going = false;
+    this->closing = false;
+    this->table_size = 0;
+    this->table_max = H2_TABLE_SIZE;
+    this->last_stream = 0;
+    this->header_stream = 0;
+    this->header_flags = 0;
+    this->window = H2_WINDOW_SIZE;
+    this->initial_window = H2_WINDOW_SIZE;
+    this->max_frame = H2_FRAME_SIZE;
+    this->max_streams = 0;
+    this->dispatching = NULL;
+}
+
+void Http2Connection::start() {
+    // the server limits the streams, the client turns pushes off
+    string settings(1, '\0');
+    if (this->server != NULL) {
+        settings += '\3';
+        settings += h2_u32(H2_MAX_STREAMS);
+    } else {
+        this->output += H2_PREFACE;
+        settings += '\2';
+        settings += h2_u32(0);
+    }
+    this->frame(SETTINGS, 0, 0, settings.data(), settings.size());
+}
+
+bool Http2Connection::consume(const char* data, const size_t& size) {
+    this->input.append(data, size);
+    size_t from = 0;
+    if (!this->preface) {
+        // the client starts with the preface, maybe over several reads
+        size_t n = min(this->input.size(), strlen(H2_PREFACE));
+        if (this->input.compare(0, n, H2_PREFACE, n) != 0) {
+            this->fail(PROTOCOL);
+        } else if (n < strlen(H2_PREFACE)) {
+            return true;
+        } else {
+            this->preface = true;
+            from = n;
+        }
+    }
+    while (!this->closing && this->input.size() - from >= 9) {
+        const unsigned char* head = 
+            (const unsigned char*)this->input.data() + from;
+        size_t length = head[0] << 16 | head[1] << 8 | head[2];
+        if (length > H2_FRAME_SIZE) {
+            this->fail(FRAME_SIZE);
+            break;
+        }
+        if (this->input.size() - from < 9 + length) {
+            break;
+        }
+        int type = head[3];
+        int flags = head[4];
+        int id = h2_read32(this->input, from + 5) & 0x7fffffff;
+        string payload = this->input.substr(from + 9, length);
+        from += 9 + length;
+        this->process(type, flags, id, payload);
+    }
+    this->input.erase(0, from);
+    if (this->going && this->streams.empty() && this->waiting.empty()) {
+        this->closing = true;
+    }
+    if (!this->flush()) {
+        this->closing = true;
+    }
+    return !this->closing;
+}
+
+bool Http2Connection::flush() {
+    while (this->connected && !this->output.empty()) {
+        ssize_t n = stream_write(this->tls, this->fd, this->output.data(),
+            this->output.size());
+        if (n > 0) {
+            this->output.erase(0, n);
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Http2Connection::frame(const int& type, const int& flags, const int& id,
+    const char* payload, const size_t& size) {
+    char head[9];
+    head[0] = (size >> 16) & 0xff;
+    head[1] = (size >> 8) & 0xff;
+    head[2] = size & 0xff;
+    head[3] = type;
+    head[4] = flags;
+    memcpy(head + 5, h2_u32(id).data(), 4);
+    this->output.append(head, 9);
+    this->output.append(payload, size);
+}
+
+void Http2Connection::fail(const int& error) {
+    // tell the last stream taken in and close once this is written out
+    string payload = h2_u32(this->server != NULL ? this->last_stream : 0) + 
+        h2_u32(error);
+    this->frame(GOAWAY, 0, 0, payload.data(), payload.size());
+    this->going = true;
+    this->closing = true;
+}
+
+void Http2Connection::process(const int& type, const int& flags, 
+    const int& id, const string& payload) {
+    if (this->header_stream != 0 && 
+        (type != CONTINUATION || id != this->header_stream)) {
+        // nothing comes between the frames of a header block
+        this->fail(PROTOCOL);
+        return;
+    }
+    switch (type) {
+        case DATA:
+            this->receive_data(flags, id, payload);
+            break;
+        case HEADERS: {
+            size_t from = 0;
+            size_t pad = 0;
+            if ((flags & PADDED) != 0 && !payload.empty()) {
+                pad = (unsigned char)payload[0];
+                from = 1;
+            }
+            if ((flags & PRIORITY) != 0) {
+                from += 5;
+            }
+            if (id == 0 || from + pad > payload.size() || 
+                ((flags & PADDED) != 0 && payload.empty())) {
+                this->fail(PROTOCOL);
+                break;
+            }
+            this->header_stream = id;
+            this->header_flags = flags;
+            this->header_block = payload.substr(from, 
+                payload.size() - from - pad);
+            if ((flags & END_HEADERS) != 0) {
+                this->end_headers();
+            }
+            break;
+        }
+        case CONTINUATION:
+            if (this->header_stream == 0 || 
+                this->header_block.size() > MAX_HEAD_SIZE) {
+                this->fail(PROTOCOL);
+                break;
+            }
+            this->header_block += payload;
+            if ((flags & END_HEADERS) != 0) {
+                this->end_headers();
+            }
+            break;
+        case RST_STREAM: {
+            if (id == 0 || payload.size() != 4) {
+                this->fail(PROTOCOL);
+                break;
+            }
+            Http2Stream* stream = this->find(id);
+            if (stream != NULL && this->server != NULL) {
+                this->close_stream(stream);
+            } else if (stream != NULL) {
+                this->finish(stream, "Stream reset");
+            }
+            break;
+        }
+        case SETTINGS:
+            if (id != 0 || payload.size() % 6 != 0 || 
+                ((flags & ACK) != 0 && !payload.empty())) {
+                this->fail(FRAME_SIZE);
+            } else if ((flags & ACK) == 0) {
+                this->configure(payload);
+                this->frame(SETTINGS, ACK, 0, NULL, 0);
+            }
+            break;
+        case PUSH_PROMISE:
+            // clients never push and pushes are turned off for servers
+            this->fail(PROTOCOL);
+            break;
+        case PING:
+            if (id != 0 || payload.size() != 8) {
+                this->fail(FRAME_SIZE);
+            } else if ((flags & ACK) == 0) {
+                this->frame(PING, ACK, 0, payload.data(), payload.size());
+            }
+            break;
+        case GOAWAY: {
+            if (id != 0 || payload.size() < 8) {
+                this->fail(FRAME_SIZE);
+                break;
+            }
+            // no new streams, and the streams after the last one taken in
+            // by the server are not processed
+            this->going = true;
+            if (this->client != NULL) {
+                int last = h2_read32(payload, 0) & 0x7fffffff;
+                if (this->client->h2_hosts.count(this->key) > 0 &&
+                    this->client->h2_hosts[this->key] == this) {
+                    this->client->h2_hosts.erase(this->key);
+                }
+                vector<Http2Stream*> refused(this->waiting.begin(), 
+                    this->waiting.end());
+                this->waiting.clear();
+                map<int, Http2Stream*>::iterator it;
+                for (it = this->streams.begin(); it != this->streams.end(); 
+                    it++) {
+                    if ((*it).first > last) {
+                        refused.push_back((*it).second);
+                    }
+                }
+                for (size_t i = 0; i < refused.size(); i++) {
+                    this->finish(refused[i], "Connection closed");
+                }
+            }
+            break;
+        }
+        case WINDOW_UPDATE: {
+            if (payload.size() != 4) {
+                this->fail(FRAME_SIZE);
+                break;
+            }
+            long long increment = h2_read32(payload, 0) & 0x7fffffff;
+            if (increment == 0) {
+                this->fail(PROTOCOL);
+                break;
+            }
+            if (id == 0) {
+                this->window += increment;
+                if (this->window > 0x7fffffff) {
+                    this->fail(FLOW_CONTROL);
+                    break;
+                }
+                this->send_all();
+                break;
+            }
+            Http2Stream* stream = this->find(id);
+            if (stream == NULL) {
+                break;
+            }
+            stream->window += increment;
+            if (stream->window <= 0x7fffffff) {
+                this->send_all();
+            } else if (this->server != NULL) {
+                // only the stream fails
+                this->close_stream(stream, FLOW_CONTROL);
+            } else {
+                string error = h2_u32(FLOW_CONTROL);
+                this->frame(RST_STREAM, 0, id, error.data(), error.size());
+                this->finish(stream, "Flow control error");
+            }
+            break;
+        }
+        default:
+            // PRIORITY and the unknown types are ignored
+            break;
+    }
+}
+
+void Http2Connection::configure(const string& payload) {
+    for (size_t i = 0; i < payload.size(); i += 6) {
+        int parameter = (unsigned char)payload[i] << 8 | 
+            (unsigned char)payload[i + 1];
+        unsigned long value = h2_read32(payload, i + 2);
+        if (parameter == 0x3) {
+            this->max_streams = value;
+        } else if (parameter == 0x4) {
+            if (value > 0x7fffffff) {
+                this->fail(FLOW_CONTROL);
+                return;
+            }
+            // the windows of the open streams move by the difference
+            long long delta = (long long)value - this->initial_window;
+            map<int, Http2Stream*>::iterator it;
+            for (it = this->streams.begin(); it != this->streams.end(); it++) {
+                (*it).second->window += delta;
+            }
+            this->initial_window = value;
+        } else if (parameter == 0x5) {
+            if (value < H2_FRAME_SIZE || value > 0xffffff) {
+                this->fail(PROTOCOL);
+                return;
+            }
+            this->max_frame = value;
+        }
+    }
+    this->send_all();
+    if (this->client != NULL) {
+        this->activate();
+    }
+}
+
+void Http2Connection::end_headers() {
+    int id = this->header_stream;
+    bool end = (this->header_flags & END_STREAM) != 0;
+    string block;
+    block.swap(this->header_block);
+    this->header_stream = 0;
+    // every block is decoded, even for a closed stream, to keep the table
+    vector<pair<string, string> > fields;
+    if (!this->decode(block, fields)) {
+        this->fail(COMPRESSION);
+    } else if (this->server != NULL) {
+        this->receive_request(id, end, fields);
+    } else {
+        this->receive_response(id, end, fields);
+    }
+}
+
+bool Http2Connection::decode(const string& block, 
+    vector<pair<string, string> >& fields) {
+    size_t pos = 0;
+    while (pos < block.size()) {
+        unsigned char first = block[pos];
+        size_t index = 0;
+        string name;
+        string value;
+        if ((first & 0x80) != 0) {
+            // indexed
+            if (!hpack_read_integer(block, pos, 7, index) || index == 0 ||
+                index > 61 + this->table.size()) {
+                return false;
+            }
+            if (index <= 61) {
+                name = HPACK_STATIC[index - 1][0];
+                value = HPACK_STATIC[index - 1][1];
+            } else {
+                name = this->table[index - 62].first;
+                value = this->table[index - 62].second;
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // the size of the table, up to what the decoder allows
+            if (!hpack_read_integer(block, pos, 5, index) || 
+                index > H2_TABLE_SIZE) {
+                return false;
+            }
+            this->table_max = index;
+            this->insert("", "");
+            continue;
+        } else {
+            // literal, with incremental indexing, without or never indexed
+            bool indexing = (first & 0xc0) == 0x40;
+            if (!hpack_read_integer(block, pos, indexing ? 6 : 4, index) ||
+                index > 61 + this->table.size()) {
+                return false;
+            }
+            if (index == 0) {
+                if (!hpack_read_string(block, pos, name)) {
+                    return false;
+                }
+            } else if (index <= 61) {
+                name = HPACK_STATIC[index - 1][0];
+            } else {
+                name = this->table[index - 62].first;
+            }
+            if (!hpack_read_string(block, pos, value)) {
+                return false;
+            }
+            if (indexing) {
+                this->insert(name, value);
+            }
+        }
+        fields.push_back(make_pair(name, value));
+    }
+    return true;
+}
+
+void Http2Connection::insert(const string& name, const string& value) {
+    // an empty entry only makes room for the size of the table
+    size_t size = name.size() + value.size() + 32;
+    if (!name.empty()) {
+        this->table.push_front(make_pair(name, value));
+        this->table_size += size;
+    }
+    while (this->table_size > this->table_max) {
+        const pair<string, string>& entry = this->table.back();
+        this->table_size -= entry.first.size() + entry.second.size() + 32;
+        this->table.pop_back();
+    }
+}
+
+Http2Stream* Http2Connection::find(const int& id) {
+    map<int, Http2Stream*>::iterator it = this->streams.find(id);
+    return it == this->streams.end() ? NULL : (*it).second;
+}
+
+void Http2Connection::send_headers(const int& id, const string& block,
+    const bool& end) {
+    // the block goes on in CONTINUATION frames if larger than a frame
+    size_t from = 0;
+    do {
+        size_t n = min(block.size() - from, this->max_frame);
+        int flags = from + n == block.size() ? END_HEADERS : 0;
+        if (from == 0) {
+            this->frame(HEADERS, flags | (end ? END_STREAM : 0), id, 
+                block.data(), n);
+        } else {
+            this->frame(CONTINUATION, flags, id, block.data() + from, n);
+        }
+        from += n;
+    } while (from < block.size());
+}
+
+void Http2Connection::send_data(Http2Stream* stream) {
+    while (stream->sent < stream->pending.size() && this->window > 0 && 
+        stream->window > 0) {
+        size_t n = min(stream->pending.size() - stream->sent, this->max_frame);
+        n = min(n, (size_t)min(this->window, stream->window));
+        bool last = stream->ending && stream->sent + n == stream->pending.size();
+        this->frame(DATA, last ? END_STREAM : 0, stream->id, 
+            stream->pending.data() + stream->sent, n);
+        stream->sent += n;
+        stream->window -= n;
+        this->window -= n;
+        if (last) {
+            stream->pending.clear();
+            stream->sent = 0;
+            if (stream->traced) {
+                this->server->loop->trace("last byte", this->fd, stream->id,
+                    IOLoop::micros());
+            }
+            if (this->server != NULL) {
+                // the response is out, stop the rest of the request if any
+                this->close_stream(stream, stream->closed ? -1 : NONE);
+            }
+            return;
+        }
+    }
+}
+
+void Http2Connection::send_all() {
+    // sending may close streams, hence the ids
+    vector<int> ids;
+    map<int, Http2Stream*>::iterator it;
+    for (it = this->streams.begin(); it != this->streams.end(); it++) {
+        if ((*it).second->sent < (*it).second->pending.size()) {
+            ids.push_back((*it).first);
+        }
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+        Http2Stream* stream = this->find(ids[i]);
+        if (stream != NULL) {
+            this->send_data(stream);
+        }
+    }
+}
+
+void Http2Connection::receive_data(const int& flags, const int& id,
+    const string& payload) {
+    size_t from = 0;
+    size_t pad = 0;
+    if ((flags & PADDED) != 0 && !payload.empty()) {
+        pad = (unsigned char)payload[0];
+        from = 1;
+    }
+    if (id == 0 || from + pad > payload.size() ||
+        ((flags & PADDED) != 0 && payload.empty())) {
+        this->fail(PROTOCOL);
+        return;
+    }
+    // the data is consumed right away, so the windows open up again
+    bool end = (flags & END_STREAM) != 0;
+    string increment = h2_u32(payload.size());
+    if (!payload.empty()) {
+        this->frame(WINDOW_UPDATE, 0, 0, increment.data(), 4);
+    }
+    Http2Stream* stream = this->find(id);
+    if (stream == NULL || stream->closed) {
+        // a stream closed, reset or cancelled already, or never opened
+        if (id > this->last_stream) {
+            this->fail(PROTOCOL);
+        }
+        return;
+    }
+    if (!payload.empty() && !end) {
+        this->frame(WINDOW_UPDATE, 0, id, increment.data(), 4);
+    }
+    const char* data = payload.data() + from;
+    size_t size = payload.size() - from - pad;
+    if (this->server != NULL) {
+        this->deliver(stream, data, size, end);
+    } else {
+        stream->body.append(data, size);
+        if (end) {
+            this->finish(stream);
+        }
+    }
+}
+
+void Http2Connection::receive_request(const int& id, const bool& end,
+    const vector<pair<string, string> >& fields) {
+    Http2Stream* stream = this->find(id);
+    if (stream != NULL) {
+        // trailers, which end the body and are not kept
+        if (!end) {
+            this->fail(PROTOCOL);
+        } else if (!stream->closed) {
+            this->deliver(stream, NULL, 0, true);
+        }
+        return;
+    }
+    if (id % 2 == 0) {
+        this->fail(PROTOCOL);
+        return;
+    }
+    if (id <= this->last_stream || this->going) {
+        // trailers of a stream closed already, or after GOAWAY
+        return;
+    }
+    this->last_stream = id;
+    if (this->streams.size() >= H2_MAX_STREAMS) {
+        string error = h2_u32(REFUSED);
+        this->frame(RST_STREAM, 0, id, error.data(), error.size());
+        return;
+    }
+    HttpRequest* request = new HttpRequest("", "");
+    string authority;
+    for (size_t i = 0; i < fields.size(); i++) {
+        const string& name = fields[i].first;
+        const string& value = fields[i].second;
+        if (name.compare(":method") == 0) {
+            request->method = value;
+        } else if (name.compare(":path") == 0) {
+            request->path = value;
+        } else if (name.compare(":authority") == 0) {
+            authority = value;
+        } else if (!name.empty() && name[0] == ':') {
+            // the scheme, or the protocol of an extended CONNECT
+        } else if (request->headers.count(name) > 0) {
+            request->headers[name] += ", " + value;
+        } else {
+            request->headers[name] = value;
+        }
+    }
+    if (!authority.empty() && request->headers.count("host") == 0) {
+        request->headers["host"] = authority;
+    }
+    bool malformed = request->method.empty() || request->path.empty();
+    if (request->headers.count("content-length") > 0) {
+        const string& value = request->headers["content-length"];
+        char* end = NULL;
+        request->length = strtoul(value.data(), &end, 10);
+        malformed = malformed || value.empty() || *end != '\0' || 
+            value[0] == '-';
+    }
+    if (malformed) {
+        delete request;
+        string error = h2_u32(PROTOCOL);
+        this->frame(RST_STREAM, 0, id, error.data(), error.size());
+        return;
+    }
+    this->serve(id, request, end);
+}
+
+void Http2Connection::serve(const int& id, HttpRequest* const request,
+    const bool& end) {
+    Http2Stream* stream = new Http2Stream(id, this->initial_window);
+    stream->closed = end;
+    stream->traced = this->server->loop->sample();
+    this->streams[id] = stream;
+    this->last_stream = max(this->last_stream, id);
+    long long start = stream->traced ? IOLoop::micros() : 0;
+    if (stream->traced) {
+        this->server->loop->trace("headers", this->fd, id, start);
+    }
+    int code = 0;
+    if (!end && request->headers.count("content-length") == 0) {
+        // as over HTTP/1.x, a body comes with its length
+        code = 411;
+    } else {
+        code = this->server->check(request, stream->pattern);
+    }
+    if (stream->traced) {
+        this->server->loop->trace("route", this->fd, id, start,
+            IOLoop::micros() - start);
+    }
+    if (code != 0) {
+        // not in flight, see check()
+        stream->pattern.clear();
+        delete request;
+        this->send_response(stream, code, "");
+        return;
+    }
+    request->fd = this->fd;
+    request->stream = id;
+    stream->request = request;
+    if (end && this->server->join(request, stream->pattern)) {
+        // the reply comes with the one of the same request in flight
+        return;
+    }
+    this->notify(stream, HEAD);
+    stream = this->find(id);
+    if (end && stream != NULL) {
+        this->deliver(stream, NULL, 0, true);
+    }
+}
+
+void Http2Connection::deliver(Http2Stream* stream, const char* data, 
+    const size_t& size, const bool& end) {
+    int id = stream->id;
+    HttpRequest* request = stream->request;
+    if (end) {
+        stream->closed = true;
+    }
+    if (request == NULL) {
+        // replied to already, the rest of the body is discarded
+        return;
+    }
+    if (size > request->length - request->received || 
+        (end && request->received + size < request->length)) {
+        // the body does not match its Content-Length
+        this->close_stream(stream, PROTOCOL);
+        return;
+    }
+    if (size > 0) {
+        request->received += size;
+        this->notify(stream, PIECE, data, size);
+        stream = this->find(id);
+    }
+    if (end && stream != NULL && stream->request != NULL) {
+        this->notify(stream, END);
+    }
+}
+
+void Http2Connection::notify(Http2Stream* const stream, const int& event,
+    const char* data, const size_t& size) {
+    // the request is deleted here if the handler replies to it, see respond()
+    HttpRequest* request = stream->request;
+    HttpRequestHandler* handler = request->handler;
+    // the stream may be closed by the handler
+    int id = stream->id;
+    bool traced = stream->traced && event != PIECE;
+    long long start = traced ? IOLoop::micros() : 0;
+    this->dispatching = request;
+    if (event == HEAD) {
+        handler->on_headers(request, request->args);
+    } else if (event == PIECE) {
+        handler->on_body_chunk(request, data, size);
+    } else {
+        handler->on_body_end(request, request->args);
+        if (!request->done && !request->deferred) {
+            request->done = true;
+            this->server->respond(request, 500, "");
+        }
+    }
+    this->dispatching = NULL;
+    if (traced) {
+        this->server->loop->trace(event == HEAD ? "on_headers" : 
+            "on_body_end", this->fd, id, start, IOLoop::micros() - start);
+    }
+    if (request->done) {
+        delete request;
+    }
+}
+
+void Http2Connection::respond(HttpRequest* const request, const int& code, 
+    const string& body) {
+    Http2Stream* stream = this->find(request->stream);
+    bool later = request != this->dispatching;
+    stream->request = NULL;
+    if (later) {
+        delete request;
+    }
+    this->send_response(stream, code, body);
+    if (later && (!this->flush() || 
+        (this->going && this->streams.empty()))) {
+        // the loop closes the connection once the rest is written out
+        this->closing = true;
+        this->server->resume(this->fd);
+    }
+}
+
+void Http2Connection::send_response(Http2Stream* const stream, 
+    const int& code, const string& body) {
+    static const int statuses[] = { 200, 204, 206, 304, 400, 404, 500 };
+    string block;
+    stringstream status;
+    status << code;
+    for (int i = 0; i < 7; i++) {
+        if (statuses[i] == code) {
+            hpack_integer(block, 0x80, 7, 8 + i);
+            status.str("");
+        }
+    }
+    if (!status.str().empty()) {
+        hpack_field(block, 8, status.str());
+    }
+    stringstream length;
+    length << body.size();
+    hpack_field(block, 28, length.str());
+    if (code == 503) {
+        stringstream retry_after;
+        retry_after << this->server->retry_after;
+        hpack_field(block, 53, retry_after.str());
+    }
+    this->send_headers(stream->id, block, body.empty());
+    if (body.empty()) {
+        if (stream->traced) {
+            this->server->loop->trace("last byte", this->fd, stream->id,
+                IOLoop::micros());
+        }
+        this->close_stream(stream, stream->closed ? -1 : NONE);
+    } else {
+        stream->pending = body;
+        stream->sent = 0;
+        stream->ending = true;
+        this->send_data(stream);
+    }
+}
+
+void Http2Connection::close_stream(Http2Stream* const stream, 
+    const int& error) {
+    if (error >= 0) {
+        string payload = h2_u32(error);
+        this->frame(RST_STREAM, 0, stream->id, payload.data(), 
+            payload.size());
+    }
+    HttpRequest* request = stream->request;
+    this->streams.erase(stream->id);
+    if (!stream->pattern.empty()) {
+        this->server->route_loads[stream->pattern]--;
+    }
+    delete stream;
+    if (request == NULL) {
+        // replied to already
+    } else if (!request->deferred) {
+        delete request;
+    } else if (!this->server->forsake(request)) {
+        // the handler still holds the request, reply() deletes it
+        request->server = NULL;
+        request->handler->on_abort(request);
+    }
+}
+
+void Http2Connection::attach(const int& fd) {
+    this->fd = fd;
+    this->client->h2_connections[fd] = this;
+    this->client->loop->set_handler(fd, this->client, 'a');
+    this->start();
+    this->activate();
+}
+
+void Http2Connection::submit(const int& fetch, 
+    HttpResponseHandler* const handler, const string& method, 
+    const string& path, const string& body) {
+    Http2Stream* stream = new Http2Stream(0, 0);
+    stream->fetch = fetch;
+    stream->handler = handler;
+    if (method.compare("GET") == 0) {
+        hpack_integer(stream->block, 0x80, 7, 2);
+    } else if (method.compare("POST") == 0) {
+        hpack_integer(stream->block, 0x80, 7, 3);
+    } else {
+        hpack_field(stream->block, 2, method);
+    }
+    hpack_integer(stream->block, 0x80, 7, 6);
+    if (path.compare("/") == 0) {
+        hpack_integer(stream->block, 0x80, 7, 4);
+    } else {
+        hpack_field(stream->block, 4, path);
+    }
+    hpack_field(stream->block, 1, this->authority);
+    if (!body.empty()) {
+        stringstream length;
+        length << body.size();
+        hpack_field(stream->block, 28, length.str());
+    }
+    stream->pending = body;
+    stream->ending = true;
+    this->waiting.push_back(stream);
+    this->activate();
+    this->flush();
+}
+
+void Http2Connection::activate() {
+    // streams wait for the connection and for the limit of the server
+    while (this->fd >= 0 && !this->going && !this->waiting.empty() && 
+        this->streams.size() < this->max_streams) {
+        Http2Stream* stream = this->waiting.front();
+        this->waiting.pop_front();
+        this->last_stream += this->last_stream == 0 ? 1 : 2;
+        stream->id = this->last_stream;
+        stream->window = this->initial_window;
+        this->streams[stream->id] = stream;
+        this->send_headers(stream->id, stream->block, stream->pending.empty());
+        stream->block.clear();
+        this->send_data(stream);
+    }
+}
+
+void Http2Connection::receive_response(const int& id, const bool& end,
+    const vector<pair<string, string> >& fields) {
+    Http2Stream* stream = this->find(id);
+    if (stream == NULL) {
+        // a cancelled stream, unless the server makes the stream up
+        if (id % 2 == 0 || id > this->last_stream) {
+            this->fail(PROTOCOL);
+        }
+        return;
+    }
+    int code = 0;
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].first.compare(":status") == 0) {
+            code = atoi(fields[i].second.data());
+        }
+    }
+    if (code >= 100 && code < 200) {
+        // an interim response, the final one follows
+        return;
+    }
+    if (code > 0) {
+        stream->code = code;
+    }
+    if (end) {
+        this->finish(stream);
+    }
+}
+
+void Http2Connection::finish(Http2Stream* const stream, const string& error) {
+    // the stream is done with before its handler may fetch again
+    if (this->find(stream->id) == stream) {
+        this->streams.erase(stream->id);
+    }
+    int fetch = stream->fetch;
+    HttpResponseHandler* handler = stream->handler;
+    if (!error.empty() || stream->code == 0) {
+        delete stream;
+        this->client->complete(fetch, handler, NULL, 
+            error.empty() ? "Malformed response" : error);
+    } else {
+        HttpResponse response(stream->code);
+        response.body.swap(stream->body);
+        delete stream;
+        this->client->complete(fetch, handler, &response);
+    }
+    this->activate();
+}
+
+void Http2Connection::cancel(const int& fetch) {
+    map<int, Http2Stream*>::iterator it;
+    for (it = this->streams.begin(); it != this->streams.end(); it++) {
+        Http2Stream* stream = (*it).second;
+        if (stream->fetch == fetch) {
+            string error = h2_u32(CANCEL);
+            this->frame(RST_STREAM, 0, stream->id, error.data(), 
+                error.size());
+            this->flush();
+            this->finish(stream, "Cancelled");
+            return;
+        }
+    }
+    list<Http2Stream*>::iterator it2;
+    for (it2 = this->waiting.begin(); it2 != this->waiting.end(); it2++) {
+        if ((*it2)->fetch == fetch) {
+            Http2Stream* stream = *it2;
+            this->waiting.erase(it2);
+            this->finish(stream, "Cancelled");
+            return;
+        }
+    }
+}
+
+void Http2Connection::abandon(const string& error) {
+    // no new streams start while the handlers are called
+    this->going = true;
+    vector<Http2Stream*> abandoned(this->waiting.begin(), this->waiting.end());
+    this->waiting.clear();
+    map<int, Http2Stream*>::iterator it;
+    for (it = this->streams.begin(); it != this->streams.end(); it++) {
+        abandoned.push_back((*it).second);
+    }
+    for (size_t i = 0; i < abandoned.size(); i++) {
+        if (this->server != NULL) {
+            this->close_stream(abandoned[i]);
+        } else {
+            this->finish(abandoned[i], error);
+        }
+    }
+}
+
+/**
+ * Http2Resolution keeps an HTTP/2 connection whose host is being resolved.
+ */
+class Http2Resolution : public DnsHandler {
+    public:
+        AsyncHttpClient* client;
+        Http2Connection* connection;
+        int port;
+        Http2Resolution(AsyncHttpClient* const client, 
+            Http2Connection* const connection, const int& port) {
+            this->client = client;
+            this->connection = connection;
+            this->port = port;
+        }
+        void handle(const vector<string>& addresses) {
+            this->client->connect(this->connection, this->port, addresses);
+        }
+        void handle_error(const string& error) {
+            this->client->connect(this->connection, this->port, 
+                vector<string>(), error);
+        }
+};
+
+// AsyncHttpClient
+
+void AsyncHttpClient::on_read(const int& fd) {
+    if (this->h2_connections.count(fd) > 0) {
+        Http2Connection* connection = this->h2_connections[fd];
+        char buffer[BUFFER_SIZE];
+        while (true) {
+            ssize_t n = read(fd, buffer, BUFFER_SIZE);
+            if (n > 0) {
+                if (!connection->consume(buffer, n)) {
+                    this->on_close(fd);
+                    return;
+                }
+            } else {
+                if (n == 0 || errno != EAGAIN) {
+                    this->on_close(fd);
+                } else if (this->socket_options.quickack) {
+                    set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+                }
+                return;
+            }
+        }
+    }
+    ssl_st* stream = find_stream(this->tls_streams, fd);
+    if (stream != NULL && !stream_established(stream)) {
+        // the handshake waited for the server, the request follows
+        if (this->handshake(fd)) {
+            this->loop->set_handler(fd, this, 'w');
+        }
+        return;
+    }
+    char buffer[BUFFER_SIZE];
+    bool done = false;
+    while (true) {
+        ssize_t n = stream_read(stream, fd, buffer, BUFFER_SIZE);
+        if (n > 0) { 
+            this->read_buffers[fd].append(buffer, n);
+        } else if (n == 0) { 
+            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
+            HttpResponse* response = 
+                HttpResponse::from_sequence(this->read_buffers[fd]);
+            if (response != NULL) {
+                if (stream != NULL) {
+                    // sessions closed without notifying cannot be resumed
+                    stream_notify(stream);
+                    this->keep_session(fd);
+                }
+                // the handler is done with, so closing reports no error
+                HttpResponseHandler* handler = this->handlers[fd];
+                this->handlers.erase(fd);
+                handler->handle(response);
+                delete response;
+                // delete the handler to de-allocate the memory
+                delete handler;
+                this->on_close(fd);
+            } else {
+                this->abort(fd, "AsyncHttpClient read error");
+            }
+            break;
+        } else {
+            if (errno == EAGAIN) {
+                // try again later, the kernel delays ACKs again meanwhile
+                if (this->socket_options.quickack) {
+                    set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+                }
+            } else {
+                done = true;
+            } 
+            break;
+        }
+    }
+    if (done) {
+        this->on_close(fd);
+    }
+}
+
+void AsyncHttpClient::on_write(const int& fd) {
+    if (this->h2_connections.count(fd) > 0) {
+        // connected, what is queued goes out now
+        Http2Connection* connection = this->h2_connections[fd];
+        connection->connected = true;
+        connection->fallbacks.clear();
+        if (!connection->flush()) {
+            this->on_close(fd);
+        }
+        return;
+    }
+    if (this->fallbacks.count(fd) > 0) {
+        // connected, the other addresses are not needed
+        delete this->fallbacks[fd];
+        this->fallbacks.erase(fd);
+    }
+    ssl_st* stream = find_stream(this->tls_streams, fd);
+    if (stream != NULL && !this->handshake(fd)) {
+        return;
+    }
+    if (this->socket_options.cork) {
+        set_option(fd, IPPROTO_TCP, TCP_CORK, 1);
+    }
+    bool error = false;
+    int n_is_zero = 0;
+    while (true) {
+        // nothing is sent once the buffer is empty, the peer may be gone
+        size_t size = this->write_buffers[fd].size();
+        ssize_t n = size == 0 ? 0 : stream_write(stream, fd, 
+            this->write_buffers[fd].data(), size);
+        if (n > 0) {
+            this->write_buffers[fd].erase(0, n);
+        } else if (n == 0) {
+            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
+            n_is_zero++;
+            if (this->write_buffers[fd].size() == 0) {
+                if (this->socket_options.cork) {
+                    set_option(fd, IPPROTO_TCP, TCP_CORK, 0);
+                }
+                // prepare the read buffer
+                this->clear_buffers(fd);
+                this->read_buffers[fd] = string();
+                this->loop->set_handler(fd, this);
+                break;
+            } else {
+                if (n_is_zero == 3) {
+                    error = true;
+                    break;
+                }
+            } 
+        } else {
+            if (errno == EAGAIN) {
+                // try again later
+            } else {
+                error = true;
+            }
+            break;
+        }
+    }
+    if (error) {
+        this->on_close(fd);
+    }
+}
+
+void AsyncHttpClient::on_close(const int& fd) {
+    // tell why the connection failed if it did, e.g. connection refused
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+    if (this->h2_connections.count(fd) > 0) {
+        // the streams fail, and new fetches to the host connect again
+        Http2Connection* connection = this->h2_connections[fd];
+        this->h2_connections.erase(fd);
+        this->loop->unset_handler(fd);
+        close(fd);
+        // what is queued goes to the next address, if any
+        while (!connection->connected && error != 0 && 
+            !connection->fallbacks.empty()) {
+            string address = connection->fallbacks[0];
+            connection->fallbacks.erase(connection->fallbacks.begin());
+            try {
+                connection->fd = open_stream(address, connection->port,
+                    this->socket_options);
+                this->h2_connections[connection->fd] = connection;
+                this->loop->set_handler(connection->fd, this, 'a');
+                return;
+            } catch (runtime_error& e) {
+            }
+        }
+        if (this->h2_hosts.count(connection->key) > 0 &&
+            this->h2_hosts[connection->key] == connection) {
+            this->h2_hosts.erase(connection->key);
+        }
+        connection->abandon(error != 0 ? strerror(error) : 
+            "Connection closed");
+        delete connection;
+        return;
+    }
+    if (error != 0 && this->reconnect(fd, strerror(error))) {
+        return;
+    }
+    this->abort(fd, error != 0 ? strerror(error) : "Connection closed");
+}
+
+void AsyncHttpClient::abort(const int& fd, const string& error) {
+    if (this->fallbacks.count(fd) > 0) {
+        delete this->fallbacks[fd];
+        this->fallbacks.erase(fd);
+    }
+    HttpResponseHandler* handler = NULL;
+    if (this->handlers.count(fd) > 0) {
+        handler = this->handlers[fd];
+        this->handlers.erase(fd);
+    }
+    if (this->tls_streams.count(fd) > 0) {
+        stream_close(this->tls_streams[fd]);
+        this->tls_streams.erase(fd);
+    }
+    if (this->ids.count(fd) > 0) {
+        int id = this->ids[fd];
+        this->fetches.erase(id);
+        this->ids.erase(fd);
+        this->host_loads[this->hosts[id]]--;
+        this->hosts.erase(id);
+    }
+    this->clear_buffers(fd);
+    this->loop->unset_handler(fd);
+    close(fd);
+    if (handler != NULL) {
+        handler->handle_error(error);
+        delete handler;
+    }
+    // a slot may have been freed for the waiting requests of the batches
+    if (!this->batches.empty()) {
+        this->pump();
+    }
+}
+
+AsyncHttpClient::AsyncHttpClient(IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    this->resolver = NULL;
+    this->resolver_owned = false;
+    this->next_id = 0;
+    this->max_per_host = 0;
+    this->pumping = false;
+    this->repump = false;
+    this->tls_context = NULL;
+    this->verify = true;
+    this->http2 = false;
+    this->retry_ratio = RETRY_RATIO;
+    this->retry_reserve = RETRY_RESERVE;
+    this->retry_tokens = RETRY_RESERVE;
+    this->retry_seed = random_seed();
+}
+
+AsyncHttpClient::~AsyncHttpClient() {
+    if (this->resolver_owned) {
+        delete this->resolver;
+    }
+}
+
+void AsyncHttpClient::set_socket_options(const SocketOptions& options) {
+    this->socket_options = options;
+}
+
+void AsyncHttpClient::keep_session(const int& fd) {
+    // the next connection to the host may start right from the handler
+    ssl_session_st* session = stream_session(this->tls_streams[fd]);
+    if (session == NULL || this->ids.count(fd) == 0) {
+        tls_free_session(session);
+        return;
+    }
+    string& key = this->hosts[this->ids[fd]];
+    if (this->tls_sessions.count(key) > 0) {
+        tls_free_session(this->tls_sessions[key]);
+    }
+    this->tls_sessions[key] = session;
+}
+
+bool AsyncHttpClient::handshake(const int& fd) {
+    ssl_st* stream = this->tls_streams[fd];
+    if (stream_established(stream)) {
+        return true;
+    }
+    string error;
+    int wait = stream_handshake(stream, error);
+    if (wait < 0) {
+        // tell why the connection failed if it did, e.g. connection refused
+        int reason = 0;
+        socklen_t reason_len = sizeof(reason);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &reason, &reason_len);
+        if (reason == 0 || !this->reconnect(fd, strerror(reason))) {
+            this->abort(fd, reason != 0 ? strerror(reason) : error);
+        }
+    } else if (wait > 0) {
+        this->loop->set_handler(fd, this, wait);
+    }
+    return wait == 0;
+}
+
+int AsyncHttpClient::fetch(const string& host, const int& port, 
+    const string& method, const string& path, const string& body, 
+    HttpResponseHandler* const handler) {
+    // addresses may come in brackets, as in URLs
+    string address = host;
+    bool tls = address.compare(0, 4, "tls:") == 0;
+    if (tls) {
+        address = address.substr(4);
+        if (this->tls_context == NULL) {
+            this->tls_context = tls_client_context(this->ca_file, 
+                this->verify);
+        }
+    }
+    if (address.size() > 2 && address[0] == '[' && 
+        address[address.size() - 1] == ']') {
+        address = address.substr(1, address.size() - 2);
+    }
+    stringstream key;
+    key << host << ":" << port;
+    if (this->http2 && !tls) {
+        return this->fetch_h2(key.str(), address, port, method, path, body,
+            handler);
+    }
+    int fd = -1;
+    if (is_address(address) || is_unix(address)) {
+        fd = open_stream(address, port, this->socket_options);
+    }
+    stringstream packet;
+    packet << method << " " << path << " HTTP/1.0\r\n" <<
+        "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    // keep track of the fetch for cancellation and the per-host limit
+    int id = ++this->next_id;
+    this->hosts[id] = key.str();
+    this->host_loads[key.str()]++;
+    if (tls) {
+        this->tls_names[id] = address;
+    }
+    if (fd >= 0) {
+        this->start(id, fd, packet.str(), handler);
+    } else {
+        // resolve the name first, which may complete right away
+        HttpResolution* resolution = new HttpResolution(this, id, port,
+            packet.str(), handler);
+        this->resolutions[id] = resolution;
+        if (this->resolver == NULL) {
+            this->resolver = new DnsResolver(this->loop);
+            this->resolver_owned = true;
+        }
+        this->resolver->resolve(address, resolution);
+    }
+    return id;
+}
+
+int AsyncHttpClient::fetch_h2(const string& key, const string& address,
+    const int& port, const string& method, const string& path, 
+    const string& body, HttpResponseHandler* const handler) {
+    // the fetch becomes a stream of the connection to the host, which is
+    // made first if there is none
+    Http2Connection* connection = NULL;
+    int fd = -1;
+    if (this->h2_hosts.count(key) > 0) {
+        connection = this->h2_hosts[key];
+    } else if (is_address(address) || is_unix(address)) {
+        fd = open_stream(address, port, this->socket_options);
+    }
+    int id = ++this->next_id;
+    this->hosts[id] = key;
+    this->host_loads[key]++;
+    bool resolving = false;
+    if (connection == NULL) {
+        stringstream authority;
+        if (is_unix(address)) {
+            authority << "localhost";
+        } else if (address.find(':') != string::npos) {
+            authority << "[" << address << "]:" << port;
+        } else {
+            authority << address << ":" << port;
+        }
+        connection = new Http2Connection(this, key, authority.str());
+        this->h2_hosts[key] = connection;
+        if (fd >= 0) {
+            connection->attach(fd);
+        } else {
+            resolving = true;
+        }
+    }
+    this->h2_fetches[id] = connection;
+    connection->submit(id, handler, method, path, body);
+    if (resolving) {
+        // which may complete, or fail the stream, right away
+        if (this->resolver == NULL) {
+            this->resolver = new DnsResolver(this->loop);
+            this->resolver_owned = true;
+        }
+        this->resolver->resolve(address, new Http2Resolution(this, 
+            connection, port));
+    }
+    return id;
+}
+
+void AsyncHttpClient::connect(Http2Connection* const connection, 
+    const int& port, const vector<string>& addresses, const string& error) {
+    string failure = error;
+    int fd = -1;
+    size_t i = 0;
+    for (; fd < 0 && i < addresses.size(); i++) {
+        try {
+            fd = open_stream(addresses[i], port, this->socket_options);
+        } catch (runtime_error& e) {
+            failure = e.what();
+        }
+    }
+    if (fd >= 0) {
+        // in case the connection fails, see on_close()
+        connection->port = port;
+        connection->fallbacks.assign(addresses.begin() + i, addresses.end());
+        connection->attach(fd);
+        return;
+    }
+    if (this->h2_hosts.count(connection->key) > 0 &&
+        this->h2_hosts[connection->key] == connection) {
+        this->h2_hosts.erase(connection->key);
+    }
+    connection->abandon(failure);
+    delete connection;
+}
+
+void AsyncHttpClient::complete(const int& id, 
+    HttpResponseHandler* const handler, HttpResponse* const response, 
+    const string& error) {
+    this->h2_fetches.erase(id);
+    this->host_loads[this->hosts[id]]--;
+    this->hosts.erase(id);
+    if (response != NULL) {
+        handler->handle(response);
+    } else {
+        handler->handle_error(error);
+    }
+    delete handler;
+    if (!this->batches.empty()) {
+        this->pump();
+    }
+}
+
+void AsyncHttpClient::start(const int& id, const int& fd, 
+    const string& packet, HttpResponseHandler* const handler) {
+    // set the write buffer and the handler.
+    this->clear_buffers(fd);
+    this->write_buffers[fd] = packet;
+    this->handlers[fd] = handler;
+    this->fetches[id] = fd;
+    this->ids[fd] = id;
+    this->loop->set_handler(fd, this, 'w');
+    if (this->tls_names.count(id) > 0) {
+        // the handshake starts once connected, resuming the last session
+        ssl_session_st* session = NULL;
+        if (this->tls_sessions.count(this->hosts[id]) > 0) {
+            session = this->tls_sessions[this->hosts[id]];
+        }
+        ssl_st* stream = stream_connect(this->tls_context, fd, 
+            this->tls_names[id], session);
+        this->tls_names.erase(id);
+        if (stream == NULL) {
+            this->abort(fd, "TLS error");
+        } else {
+            this->tls_streams[fd] = stream;
+        }
+    }
+}
+
+void AsyncHttpClient::resolved(HttpResolution* const resolution,
+    const vector<string>& addresses, const string& error) {
+    this->resolutions.erase(resolution->id);
+    this->dial(resolution->id, resolution->port, addresses, 
+        resolution->packet, resolution->handler, error);
+}
+
+void AsyncHttpClient::dial(const int& id, const int& port, 
+    const vector<string>& addresses, const string& packet,
+    HttpResponseHandler* const handler, const string& error) {
+    string failure = error;
+    int fd = -1;
+    size_t i = 0;
+    for (; fd < 0 && i < addresses.size(); i++) {
+        try {
+            fd = open_stream(addresses[i], port, this->socket_options);
+        } catch (runtime_error& e) {
+            failure = e.what();
+        }
+    }
+    if (fd < 0) {
+        this->host_loads[this->hosts[id]]--;
+        this->hosts.erase(id);
+        this->tls_names.erase(id);
+        handler->handle_error(failure);
+        delete handler;
+        if (!this->batches.empty()) {
+            this->pump();
+        }
+        return;
+    }
+    if (i < addresses.size()) {
+        // in case the connection fails, see reconnect()
+        HttpFallback* fallback = new HttpFallback();
+        fallback->id = id;
+        fallback->port = port;
+        fallback->packet = packet;
+        if (this->tls_names.count(id) > 0) {
+            fallback->tls_name = this->tls_names[id];
+        }
+        fallback->addresses.assign(addresses.begin() + i, addresses.end());
+        this->fallbacks[fd] = fallback;
+    }
+    this->start(id, fd, packet, handler);
+}
+
+bool AsyncHttpClient::reconnect(const int& fd, const string& error) {
+    if (this->fallbacks.count(fd) == 0) {
+        return false;
+    }
+    HttpFallback* fallback = this->fallbacks[fd];
+    this->fallbacks.erase(fd);
+    // the fetch leaves the connection as it came, still in flight
+    HttpResponseHandler* handler = this->handlers[fd];
+    this->handlers.erase(fd);
+    this->fetches.erase(fallback->id);
+    this->ids.erase(fd);
+    if (this->tls_streams.count(fd) > 0) {
+        stream_close(this->tls_streams[fd]);
+        this->tls_streams.erase(fd);
+    }
+    this->clear_buffers(fd);
+    this->loop->unset_handler(fd);
+    close(fd);
+    if (!fallback->tls_name.empty()) {
+        this->tls_names[fallback->id] = fallback->tls_name;
+    }
+    this->dial(fallback->id, fallback->port, fallback->addresses, 
+        fallback->packet, handler, error);
+    delete fallback;
+    return true;
+}
+
+void AsyncHttpClient::cancel(const int& id) {
+    if (this->fetches.count(id) > 0) {
+        // a copy, as aborting erases the entry
+        int fd = this->fetches[id];
+        this->abort(fd, "Cancelled");
+    } else if (this->resolutions.count(id) > 0) {
+        // the resolver still calls the resolution, which then does nothing
+        this->resolutions[id]->client = NULL;
+        vector<string> none;
+        HttpResolution* resolution = this->resolutions[id];
+        this->resolved(resolution, none, "Cancelled");
+    } else if (this->h2_fetches.count(id) > 0) {
+        this->h2_fetches[id]->cancel(id);
+    } else if (this->retries.count(id) > 0) {
+        this->finish(this->retries[id], NULL, "Cancelled");
+    }
+}
+
+void AsyncHttpClient::set_resolver(DnsResolver* const resolver) {
+    if (this->resolver_owned && this->resolver != resolver) {
+        delete this->resolver;
+    }
+    this->resolver = resolver;
+    this->resolver_owned = false;
+}
+
+void AsyncHttpClient::set_tls_trust(const string& ca_file, 
+    const bool& verify) {
+    // the context is created again on the next request over TLS
+    this->ca_file = ca_file;
+    this->verify = verify;
+    if (this->tls_context != NULL) {
+        tls_free_context(this->tls_context);
+        this->tls_context = NULL;
+    }
+}
+
+void AsyncHttpClient::fetch_all(const vector<HttpClientRequest>& requests,
+    HttpBatchHandler* const handler, const int& concurrency, 
+    const int& deadline) {
+    HttpBatch* batch = new HttpBatch();
+    batch->client = this;
+    batch->handler = handler;
+    batch->requests = requests;
+    batch->responses.assign(requests.size(), NULL);
+    batch->errors.assign(requests.size(), string());
+    batch->states.assign(requests.size(), HttpBatch::PENDING);
+    batch->ids.assign(requests.size(), 0);
+    batch->concurrency = concurrency;
+    batch->running = 0;
+    batch->remaining = requests.size();
+    batch->timeout = -1;
+    batch->expired = false;
+    if (deadline > 0) {
+        batch->timeout = this->loop->add_timeout(deadline, batch);
+    }
+    this->batches.push_back(batch);
+    this->pump();
+}
+
+void AsyncHttpClient::set_max_per_host(const int& max) {
+    this->max_per_host = max;
+}
+
+void AsyncHttpClient::set_http2(const bool& enabled) {
+    this->http2 = enabled;
+}
+
+void AsyncHttpClient::set_retry_budget(const double& ratio, 
+    const int& reserve) {
+    this->retry_ratio = ratio;
+    this->retry_reserve = reserve;
+    this->retry_tokens = min(this->retry_tokens, (double)reserve);
+}
+
+int AsyncHttpClient::fetch(const HttpClientRequest& request,
+    const HttpRetryPolicy& policy, HttpResponseHandler* const handler) {
+    int id = ++this->next_id;
+    HttpRetry* retry = new HttpRetry(this, id, request, policy, handler);
+    const string& method = request.method;
+    if (method.compare("GET") != 0 && method.compare("HEAD") != 0 &&
+        method.compare("PUT") != 0 && method.compare("DELETE") != 0 &&
+        method.compare("OPTIONS") != 0 && method.compare("TRACE") != 0) {
+        // made twice, the request could take effect twice
+        retry->policy.attempts = 1;
+    }
+    this->retries[id] = retry;
+    this->retry_tokens = min(this->retry_tokens + this->retry_ratio, 
+        (double)this->retry_reserve);
+    // which may finish the fetch right away
+    this->launch(retry);
+    return id;
+}
+
+void AsyncHttpClient::launch(HttpRetry* const retry) {
+    // the host of the request first, then the replicas in turn
+    int index = retry->ids.size();
+    string host = retry->request.host;
+    int port = retry->request.port;
+    size_t turn = index % (retry->policy.replicas.size() + 1);
+    if (turn > 0) {
+        host = retry->policy.replicas[turn - 1].first;
+        port = retry->policy.replicas[turn - 1].second;
+    }
+    stringstream key;
+    key << host << ":" << port;
+    retry->ids.push_back(0);
+    retry->keys.push_back(key.str());
+    retry->starts.push_back(IOLoop::now());
+    retry->finished.push_back(false);
+    retry->running++;
+    // the request may fail before fetch() returns, which must not delete the
+    // fetch under the policy yet
+    retry->launching = true;
+    HttpRetryAttempt* attempt = new HttpRetryAttempt(retry, index);
+    string failure;
+    try {
+        retry->ids[index] = this->fetch(host, port, retry->request.method,
+            retry->request.path, retry->request.body, attempt);
+    } catch (runtime_error& e) {
+        delete attempt;
+        failure = e.what();
+    }
+    retry->launching = false;
+    if (!failure.empty()) {
+        this->settle(retry, index, NULL, failure);
+        return;
+    }
+    if (retry->done) {
+        this->release(retry);
+        return;
+    }
+    if (retry->finished[index] || retry->running > 1 ||
+        retry->policy.hedge_delay <= 0 || 
+        (int)retry->ids.size() >= retry->policy.attempts) {
+        return;
+    }
+    // hedge the request if it takes longer than most of the host's
+    int delay = retry->policy.hedge_delay;
+    const list<int>& samples = this->latencies[key.str()];
+    if (retry->policy.hedge_percentile > 0 && 
+        samples.size() >= HEDGE_MIN_SAMPLES) {
+        vector<int> sorted(samples.begin(), samples.end());
+        size_t k = (size_t)(retry->policy.hedge_percentile * 
+            (sorted.size() - 1));
+        nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        delay = sorted[k];
+    }
+    retry->timeout = this->loop->add_timeout(delay, retry);
+}
+
+void AsyncHttpClient::resume(HttpRetry* const retry) {
+    retry->timeout = -1;
+    if (retry->running == 0) {
+        // the backoff is over, the retry is paid for already
+        this->launch(retry);
+    } else if (this->retry_tokens >= 1) {
+        // the request in flight is slow, race it
+        this->retry_tokens -= 1;
+        this->launch(retry);
+    }
+}
+
+void AsyncHttpClient::settle(HttpRetry* const retry, const int& index,
+    HttpResponse* const response, const string& error) {
+    retry->finished[index] = true;
+    retry->running--;
+    if (retry->done) {
+        // lost the race, or cancelled
+        this->release(retry);
+        return;
+    }
+    if (response != NULL) {
+        list<int>& samples = this->latencies[retry->keys[index]];
+        samples.push_back((int)(IOLoop::now() - retry->starts[index]));
+        if (samples.size() > LATENCY_SAMPLES) {
+            samples.pop_front();
+        }
+        if (response->code != 502 && response->code != 503 && 
+            response->code != 504) {
+            this->finish(retry, response);
+            return;
+        }
+    }
+    // kept in case no other request does better
+    delete retry->response;
+    retry->response = NULL;
+    if (response != NULL) {
+        retry->response = new HttpResponse(response->code);
+        retry->response->body.swap(response->body);
+    }
+    retry->error = error;
+    if (retry->running > 0) {
+        // the hedge, or the hedged request, may still succeed
+        return;
+    }
+    if (retry->timeout >= 0) {
+        this->loop->remove_timeout(retry->timeout);
+        retry->timeout = -1;
+    }
+    if ((int)retry->ids.size() < retry->policy.attempts && 
+        this->retry_tokens >= 1) {
+        // wait for a random part of the backoff, so that the clients that
+        // failed together do not retry together
+        this->retry_tokens -= 1;
+        long long backoff = (long long)retry->policy.backoff << 
+            min((int)retry->ids.size() - 1, 20);
+        backoff = min(backoff, (long long)retry->policy.max_backoff);
+        int delay = backoff > 0 ? 
+            next_random(this->retry_seed) % (backoff + 1) : 0;
+        retry->timeout = this->loop->add_timeout(delay, retry);
+        return;
+    }
+    this->finish(retry, retry->response, retry->error);
+}
+
+void AsyncHttpClient::finish(HttpRetry* const retry, 
+    HttpResponse* const response, const string& error) {
+    retry->done = true;
+    this->retries.erase(retry->id);
+    if (retry->timeout >= 0) {
+        this->loop->remove_timeout(retry->timeout);
+        retry->timeout = -1;
+    }
+    if (response != NULL) {
+        retry->handler->handle(response);
+    } else {
+        retry->handler->handle_error(error);
+    }
+    delete retry->handler;
+    retry->handler = NULL;
+    // the last of the requests cancelled deletes the fetch, hence the copy
+    vector<int> losers;
+    for (size_t i = 0; i < retry->ids.size(); i++) {
+        if (!retry->finished[i]) {
+            losers.push_back(retry->ids[i]);
+        }
+    }
+    if (losers.empty()) {
+        this->release(retry);
+    }
+    for (size_t i = 0; i < losers.size(); i++) {
+        this->cancel(losers[i]);
+    }
+}
+
+void AsyncHttpClient::release(HttpRetry* const retry) {
+    if (retry->done && retry->running == 0 && !retry->launching) {
+        delete retry;
+    }
+}
+
+void AsyncHttpClient::pump() {
+    // handlers called from here may make new batches, which are then pumped
+    // by the outer call
+    if (this->pumping) {
+        this->repump = true;
+        return;
+    }
+    this->pumping = true;
+    do {
+        this->repump = false;
+        list<HttpBatch*>::iterator it = this->batches.begin();
+        while (it != this->batches.end()) {
+            HttpBatch* batch = *it;
+            for (size_t i = 0; i < batch->requests.size(); i++) {
+                if (batch->concurrency > 0 && 
+                    batch->running >= batch->concurrency) {
+                    break;
+                }
+                if (batch->states[i] != HttpBatch::PENDING) {
+                    continue;
+                }
+                const HttpClientRequest& request = batch->requests[i];
+                stringstream key;
+                key << request.host << ":" << request.port;
+                if (this->max_per_host > 0 &&
+                    this->host_loads[key.str()] >= this->max_per_host) {
+                    continue;
+                }
+                HttpBatchMember* member = new HttpBatchMember(batch, i);
+                batch->states[i] = HttpBatch::RUNNING;
+                batch->running++;
+                try {
+                    batch->ids[i] = this->fetch(request.host, request.port,
+                        request.method, request.path, request.body, member);
+                } catch (runtime_error& e) {
+                    delete member;
+                    this->record(batch, i, NULL, e.what());
+                }
+            }
+            if (batch->remaining == 0) {
+                // every request is done, hand the responses over
+                it = this->batches.erase(it);
+                if (batch->timeout >= 0) {
+                    this->loop->remove_timeout(batch->timeout);
+                }
+                batch->handler->handle(batch->responses, batch->errors);
+                for (size_t i = 0; i < batch->responses.size(); i++) {
+                    delete batch->responses[i];
+                }
+                delete batch->handler;
+                delete batch;
+            } else {
+                it++;
+            }
+        }
+    } while (this->repump);
+    this->pumping = false;
+}
+
+void AsyncHttpClient::record(HttpBatch* const batch, const int& index,
+    HttpResponse* const response, const string& error) {
+    if (batch->states[index] == HttpBatch::RUNNING) {
+        batch->running--;
+    }
+    batch->states[index] = HttpBatch::DONE;
+    batch->remaining--;
+    if (response != NULL) {
+        // take the body over instead of copying it
+        HttpResponse* kept = new HttpResponse(response->code);
+        kept->body.swap(response->body);
+        batch->responses[index] = kept;
+    } else if (batch->expired) {
+        batch->errors[index] = "Deadline exceeded";
+    } else {
+        batch->errors[index] = error;
+    }
+}
+
+void AsyncHttpClient::expire(HttpBatch* const batch) {
+    batch->timeout = -1;
+    batch->expired = true;
+    vector<int> running;
+    for (size_t i = 0; i < batch->requests.size(); i++) {
+        if (batch->states[i] == HttpBatch::PENDING) {
+            batch->states[i] = HttpBatch::DONE;
+            batch->errors[i] = "Deadline exceeded";
+            batch->remaining--;
+        } else if (batch->states[i] == HttpBatch::RUNNING) {
+            running.push_back(batch->ids[i]);
+        }
+    }
+    // the batch completes, and is deleted, when the last one is cancelled
+    if (running.empty()) {
+        this->pump();
+    }
+    for (size_t i = 0; i < running.size(); i++) {
+        this->cancel(running[i]);
+    }
+}
+
+// AsyncHttpServer
+
+string AsyncHttpServer::find_pattern(const string& path) {
+    vector<pair<string, HttpRequestHandler*> >::iterator it;
+    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
+        regex_t preg;
+        if (regcomp(&preg, (*it).first.data(), REG_EXTENDED | REG_NOSUB) == 0) {
+            if (regexec(&preg, path.data(), 0, NULL, 0) == 0) {
+                regfree(&preg);
+                return (*it).first;
+            }
+            regfree(&preg);
+        }
+    }
+    return string();
+}
+
+HttpRequestHandler* AsyncHttpServer::find_handler(const string& path) {
+    string pattern = this->find_pattern(path);
+    vector<pair<string, HttpRequestHandler*> >::iterator it;
+    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
+        if ((*it).first.compare(pattern) == 0) {
+            return (*it).second;
+        }
+    }
+    return NULL;
+}
+
+vector<string> AsyncHttpServer::get_arguments(const string& path) {
+    vector<string> args;
+    vector<pair<string, HttpRequestHandler*> >::iterator it;
+    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
+        regex_t preg;
+        if (regcomp(&preg, (*it).first.data(), REG_EXTENDED) == 0) {
+            size_t nmatch = MAX_NMATCH;
+            regmatch_t pmatch[nmatch];
+            if (regexec(&preg, path.data(), nmatch, pmatch, 0) == 0) {
+                for (int i = 1; i < nmatch; i++) {
+                    if (pmatch[i].rm_so == -1) {
+                        break;
+                    }
+                    int n = pmatch[i].rm_eo - pmatch[i].rm_so;
+                    args.push_back(string(path.data() + pmatch[i].rm_so, n));
+                }
+                regfree(&preg);
+                break;
+            }
+            regfree(&preg);
+        }
+    }
+    return args;
+}
+
+void AsyncHttpServer::reply(const int& fd, const int& code, 
+    const string& body) {
+    this->clear_buffers(fd);
+    this->write_buffers[fd] = HttpResponse::to_sequence(code, body);
+}
+
+int AsyncHttpServer::detach(const int& fd, string& pending) {
+    if (this->tls_streams.count(fd) > 0) {
+        // the kernel goes on with the session without OpenSSL
+        if (!stream_offloaded(this->tls_streams[fd])) {
+            return -1;
+        }
+        stream_close(this->tls_streams[fd]);
+        this->tls_streams.erase(fd);
+    }
+    pending.swap(this->read_buffers[fd]);
+    this->clear_buffers(fd);
+    this->traced.erase(fd);
+    if (this->routes.count(fd) > 0) {
+        this->route_loads[this->routes[fd]]--;
+        this->routes.erase(fd);
+    }
+    this->connections.erase(fd);
+    this->loop->unset_handler(fd);
+    return fd;
+}
+
+void AsyncHttpServer::shed(const int& fd) {
+    // drain what the client has sent so far, otherwise closing the socket
+    // resets the connection and the client may never see the response
+    char buffer[BUFFER_SIZE];
+    while (recv(fd, buffer, BUFFER_SIZE, MSG_DONTWAIT) > 0) {
+    }
+    send(fd, this->overload.data(), this->overload.size(),
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+int AsyncHttpServer::check(HttpRequest* const request, string& pattern) {
+    // find a handler to handle the request
+    pattern = this->find_pattern(request->path);
+    HttpRequestHandler* handler = this->find_handler(request->path);
+    // looked up without adding an entry per pattern, e.g. "" for 404s
+    map<string, int>::iterator it = this->route_limits.find(pattern);
+    int limit = it != this->route_limits.end() ? (*it).second : 0;
+    map<string, size_t>::iterator it2 = this->body_limits.find(pattern);
+    size_t max_body = it2 != this->body_limits.end() ? (*it2).second : 0;
+    if (handler == NULL) {
+        return 404;
+    } else if (request->headers.count("transfer-encoding") > 0) {
+        return 411;
+    } else if (max_body > 0 && request->length > max_body) {
+        return 413;
+    } else if (limit > 0 && this->route_loads[pattern] >= limit) {
+        // too many requests in flight, shed this one
+        return 503;
+    }
+    // in flight until the response is written out
+    this->route_loads[pattern]++;
+    request->args = this->get_arguments(request->path);
+    request->handler = handler;
+    request->server = this;
+    request->done = false;
+    request->deferred = false;
+    return 0;
+}
+
+bool AsyncHttpServer::admit(const int& fd, HttpRequest* const request) {
+    string pattern;
+    bool traced = this->traced.count(fd) > 0;
+    long long start = traced ? IOLoop::micros() : 0;
+    int code = this->check(request, pattern);
+    if (traced) {
+        this->loop->trace("route", fd, 0, start, IOLoop::micros() - start);
+    }
+    if (code == 0) {
+        this->routes[fd] = pattern;
+        request->fd = fd;
+        return true;
+    } else if (code == 503) {
+        this->clear_buffers(fd);
+        this->write_buffers[fd] = this->overload;
+    } else {
+        this->reply(fd, code);
+    }
+    return false;
+}
+
+bool AsyncHttpServer::consume(const int& fd, const char* data, 
+    const size_t& size) {
+    if (this->h2_connections.count(fd) > 0) {
+        return this->h2_connections[fd]->consume(data, size);
+    }
+    HttpRequest* request = NULL;
+    if (this->requests.count(fd) == 0) {
+        // the head is not complete yet, buffer until the empty line
+        string& buffer = this->read_buffers[fd];
+        bool traced = this->traced.count(fd) > 0;
+        if (traced && buffer.empty()) {
+            this->loop->trace("first byte", fd, 0, IOLoop::micros());
+        }
+        size_t from = buffer.size() < 3 ? 0 : buffer.size() - 3;
+        buffer.append(data, size);
+        size_t p = buffer.find("\r\n\r\n", from);
+        if (p == string::npos) {
+            if (buffer.size() > MAX_HEAD_SIZE) {
+                this->reply(fd, 400);
+                return false;
+            }
+            return true;
+        }
+        request = HttpRequest::from_sequence(buffer.substr(0, p + 4));
+        if (request == NULL) {
+            this->reply(fd, 400);
+            return false;
+        }
+        if (request->method.compare("PRI") == 0 && 
+            request->path.compare("*") == 0) {
+            // the preface of HTTP/2, frames follow
+            delete request;
+            string pending;
+            pending.swap(buffer);
+            return this->upgrade(fd, NULL, pending);
+        }
+        if (to_lower(request->get_header("Upgrade")).compare("h2c") == 0 &&
+            request->headers.count("http2-settings") > 0 && 
+            request->length == 0 && this->tls_streams.count(fd) == 0) {
+            return this->upgrade(fd, request, buffer.substr(p + 4));
+        }
+        if (traced) {
+            this->loop->trace("headers", fd, 0, IOLoop::micros());
+        }
+        if (!this->admit(fd, request)) {
+            delete request;
+            return false;
+        }
+        if (this->join(request, this->routes[fd])) {
+            // the reply comes with the one of the same request in flight
+            this->requests[fd] = request;
+            return false;
+        }
+        // the rest of the buffer, if any, is the beginning of the body
+        this->read_buffers[fd] = buffer.substr(p + 4);
+        long long start = traced ? IOLoop::micros() : 0;
+        request->handler->on_headers(request, request->args);
+        if (traced) {
+            this->loop->trace("on_headers", fd, 0, start, 
+                IOLoop::micros() - start);
+        }
+        if (request->done) {
+            // replied to or detached by the handler already
+            delete request;
+            return false;
+        }
+        this->requests[fd] = request;
+        string rest;
+        rest.swap(this->read_buffers[fd]);
+        if (rest.empty() && request->length > 0 &&
+            request->version.compare("HTTP/1.1") == 0 &&
+            to_lower(request->get_header("Expect")).compare(
+                "100-continue") == 0) {
+            // the client waits for this before sending the body
+            string interim = status_line(100) + "\r\n";
+            stream_write(find_stream(this->tls_streams, fd), fd, 
+                interim.data(), interim.size());
+        }
+        return this->consume(fd, rest.data(), rest.size());
+    }
+    request = this->requests[fd];
+    if (request->done || (size > 0 && request->deferred && 
+        request->received == request->length)) {
+        // replied to already, or the body is over and the reply comes later
+        return false;
+    }
+    HttpRequestHandler* handler = request->handler;
+    size_t n = min(size, request->length - request->received);
+    if (n > 0) {
+        request->received += n;
+        handler->on_body_chunk(request, data, n);
+    }
+    if (!request->done && request->received == request->length) {
+        bool traced = this->traced.count(fd) > 0;
+        long long start = traced ? IOLoop::micros() : 0;
+        handler->on_body_end(request, request->args);
+        if (traced) {
+            this->loop->trace("on_body_end", fd, 0, start, 
+                IOLoop::micros() - start);
+        }
+        if (!request->done && !request->deferred) {
+            request->done = true;
+            this->respond(request, 500, "");
+        }
+    }
+    if (request->done) {
+        this->requests.erase(fd);
+        delete request;
+        return false;
+    }
+    return !request->deferred || request->received < request->length;
+}
+
+void AsyncHttpServer::on_read(const int& fd) {
+    if (this->listeners.count(fd) > 0) {   
+        // read on listening socket, keep accepting
+        while (true) {
+            struct sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            int cfd = accept(fd, (struct sockaddr*)&addr, &addr_len);
+            if (cfd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;  
+                } else {
+                    throw runtime_error(strerror(errno));
+                }
+            } else if (this->max_connections > 0 &&
+                this->connections.size() >= (size_t)this->max_connections) {
+                // too many connections, reply 503 instead of queuing, which
+                // TLS does not allow before the handshake
+                if (this->tls_contexts.count(fd) > 0) {
+                    close(cfd);
+                } else {
+                    this->shed(cfd);
+                }
+            } else {
+                // the client speaks first in the TLS handshake
+                if (this->tls_contexts.count(fd) > 0) {
+                    ssl_st* stream = stream_accept(this->tls_contexts[fd], 
+                        cfd);
+                    if (stream == NULL) {
+                        close(cfd);
+                        continue;
+                    }
+                    this->tls_streams[cfd] = stream;
+                }
+                // prepare the read buffer for the accepted socket
+                this->clear_buffers(cfd);
+                this->read_buffers[cfd] = string();
+                this->connections.insert(cfd);
+                this->loop->set_handler(cfd, this);
+                // the other options are inherited from the listener
+                if (this->socket_options.quickack) {
+                    set_option(cfd, IPPROTO_TCP, TCP_QUICKACK, 1);
+                }
+                if (this->loop->sample()) {
+                    this->traced.insert(cfd);
+                    this->loop->trace("accept", cfd, 0, IOLoop::micros());
+                }
+            }
+        }
+
+    } else if (this->tls_streams.count(fd) > 0 && !this->handshake(fd)) {
+        // the handshake is not complete yet
+    } else {                
+        // read on existing socket, keep reading until EAGAIN or until a
+        // response has been prepared
+        ssl_st* stream = find_stream(this->tls_streams, fd);
+        char buffer[BUFFER_SIZE];
+        bool error = false;
+        while (true) {
+            ssize_t n = stream_read(stream, fd, buffer, BUFFER_SIZE);
+            if (n > 0) {            
+                if (!this->consume(fd, buffer, n)) {
+                    // unless the connection has been detached or the reply
+                    // to the request comes later
+                    if (this->connections.count(fd) > 0 &&
+                        this->requests.count(fd) == 0) {
+                        this->loop->set_handler(fd, this, 'w'); 
+                    }
+                    break;
+                }
+            } else if (n == 0) {    
+                // socket close 
+                error = true;
+                break;
+            } else { 
+                if (errno != EAGAIN) {
+                    error = true;
+                } else if (this->socket_options.quickack) {
+                    // the kernel delays ACKs again after a while
+                    set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+                }
+                break;
+            }
+        }
+        if (error) {
+            this->on_close(fd);
+        }
+    }
+}
+
+void AsyncHttpServer::on_write(const int& fd) {
+    ssl_st* stream = find_stream(this->tls_streams, fd);
+    if (stream != NULL && !stream_established(stream)) {
+        // the handshake waited for the socket, the request follows
+        if (this->handshake(fd)) {
+            this->loop->set_handler(fd, this);
+        }
+        return;
+    }
+    if (this->h2_connections.count(fd) > 0) {
+        // the connection stays open until it fails or is going away
+        Http2Connection* connection = this->h2_connections[fd];
+        if (!connection->flush() || 
+            (connection->closing && connection->output.empty())) {
+            this->on_close(fd);
+        }
+        return;
+    }
+    if (this->socket_options.cork) {
+        set_option(fd, IPPROTO_TCP, TCP_CORK, 1);
+    }
+    bool done = false;
+    bool error = false;
+    int n_is_zero = 0;
+    while (true) {
+        // nothing is sent once the buffer is empty, the peer may be gone
+        size_t size = this->write_buffers[fd].size();
+        ssize_t n = size == 0 ? 0 : stream_write(stream, fd, 
+            this->write_buffers[fd].data(), size);
+        if (n > 0) {
+            this->write_buffers[fd].erase(0, n); 
+        } else if (n == 0) {
+            // somehow it gets n=0 instead of n=-1 with errno=EAGAIN
+            n_is_zero++;
+            if (this->write_buffers[fd].size() == 0) {
+                done = true;
+                break;
+            } else {
+                if (n_is_zero == 3) {
+                    error = true;
+                    break;
+                }
+            }
+        } else {
+            if (errno == EAGAIN) {
+                // try again later
+            } else {
+                error = true;
+            }
+            break;
+        }
+    }
+    if (done && this->socket_options.cork) {
+        set_option(fd, IPPROTO_TCP, TCP_CORK, 0);
+    }
+    if (done && this->traced.count(fd) > 0) {
+        this->loop->trace("last byte", fd, 0, IOLoop::micros());
+    }
+    if (done) {
+        // discard what is left of a rejected body so that closing does not
+        // reset the connection before the client reads the response
+        char buffer[BUFFER_SIZE];
+        if (stream != NULL) {
+            stream_notify(stream);
+        }
+        shutdown(fd, SHUT_WR);
+        while (recv(fd, buffer, BUFFER_SIZE, MSG_DONTWAIT) > 0) {
+        }
+    }
+    if (done || error) {
+        this->on_close(fd);
+    }
+    if (error) {
+        throw runtime_error("AsyncHttpServer write error");
+    }
+}
+
+void AsyncHttpServer::on_close(const int& fd) {
+    Http2Connection* connection = NULL;
+    if (this->h2_connections.count(fd) > 0) {
+        connection = this->h2_connections[fd];
+        this->h2_connections.erase(fd);
+    }
+    if (this->routes.count(fd) > 0) {
+        this->route_loads[this->routes[fd]]--;
+        this->routes.erase(fd);
+    }
+    HttpRequest* abandoned = NULL;
+    if (this->requests.count(fd) > 0) {
+        HttpRequest* request = this->requests[fd];
+        this->requests.erase(fd);
+        if (request->deferred && !request->done) {
+            if (!this->forsake(request)) {
+                // the handler still holds the request, reply() deletes it
+                request->server = NULL;
+                abandoned = request;
+            }
+        } else {
+            delete request;
+        }
+    }
+    if (this->tls_streams.count(fd) > 0) {
+        stream_close(this->tls_streams[fd]);
+        this->tls_streams.erase(fd);
+    }
+    this->connections.erase(fd);
+    this->traced.erase(fd);
+    this->clear_buffers(fd);
+    this->loop->unset_handler(fd);
+    close(fd);
+    if (abandoned != NULL) {
+        abandoned->handler->on_abort(abandoned);
+    }
+    if (connection != NULL) {
+        connection->abandon("Connection closed");
+        delete connection;
+    }
+}
+
+void AsyncHttpServer::resume(const int& fd) {
+    this->loop->set_handler(fd, this, 'w');
+}
+
+void AsyncHttpServer::respond(HttpRequest* const request, const int& code,
+    const string& body) {
+    if (!request->flight.empty()) {
+        this->land(request, code, body);
+    }
+    if (request->fd < 0) {
+        // the client is gone, only the requests waiting for it were left
+        delete request;
+        return;
+    }
+    if (request->stream > 0) {
+        this->h2_connections[request->fd]->respond(request, code, body);
+        return;
+    }
+    this->reply(request->fd, code, body);
+    if (request->deferred) {
+        this->resume(request->fd);
+    }
+}
+
+bool AsyncHttpServer::upgrade(const int& fd, HttpRequest* const request,
+    const string& pending) {
+    string settings;
+    if (request != NULL && 
+        !h2_settings(request->get_header("HTTP2-Settings"), settings)) {
+        delete request;
+        this->reply(fd, 400);
+        return false;
+    }
+    Http2Connection* connection = new Http2Connection(this, fd, 
+        find_stream(this->tls_streams, fd));
+    this->h2_connections[fd] = connection;
+    this->clear_buffers(fd);
+    // written out as soon as there is something to write
+    this->loop->set_handler(fd, this, 'a');
+    if (request != NULL) {
+        connection->output = "HTTP/1.1 101 Switching Protocols\r\n"
+            "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    }
+    connection->start();
+    if (request != NULL) {
+        // the settings of the client hold from the first stream on, without
+        // being acknowledged, and the request is that stream, half-closed
+        connection->configure(settings);
+        if (connection->closing) {
+            // the settings are out of range, GOAWAY is on its way
+            delete request;
+            return false;
+        }
+        connection->serve(1, request, true);
+    }
+    return connection->consume(pending.data(), pending.size());
+}
+
+bool AsyncHttpServer::handshake(const int& fd) {
+    ssl_st* stream = this->tls_streams[fd];
+    if (stream_established(stream)) {
+        return true;
+    }
+    string error;
+    int wait = stream_handshake(stream, error);
+    if (wait < 0) {
+        this->on_close(fd);
+    } else if (wait > 0) {
+        this->loop->set_handler(fd, this, wait);
+    }
+    return wait == 0;
+}
+
+AsyncHttpServer::AsyncHttpServer(const int& port, IOLoop* const loop) {
+    this->init(loop);
+    this->add_listener(port);
+}
+
+AsyncHttpServer::AsyncHttpServer(const string& path, IOLoop* const loop) {
+    this->init(loop);
+    this->add_listener(path);
+}
+
+void AsyncHttpServer::init(IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    // set the admission limits
+    this->backlog = LISTEN_BACKLOG;
+    this->max_connections = 0;
+    this->set_retry_after(RETRY_AFTER);
+}
+
+int AsyncHttpServer::add_listener(const int& port) {
+    // create a socket, bind and listen to the port
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        throw runtime_error(strerror(errno));
+    }
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        close(fd);
+        throw runtime_error(strerror(errno));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        throw runtime_error(strerror(errno));
+    }
+    return this->listen_to(fd);
+}
+
+int AsyncHttpServer::add_listener(const int& port, const string& cert_file,
+    const string& key_file) {
+    ssl_ctx_st* context = tls_server_context(cert_file, key_file);
+    int fd;
+    try {
+        fd = this->add_listener(port);
+    } catch (runtime_error& e) {
+        tls_free_context(context);
+        throw;
+    }
+    this->tls_contexts[fd] = context;
+    return fd;
+}
+
+int AsyncHttpServer::add_listener(const string& path) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = unix_address(path, &addr);
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        throw runtime_error(strerror(errno));
+    }
+    // a socket file left over by a previous run would make bind() fail
+    struct stat st;
+    if (path[0] != '@' && stat(path.data(), &st) == 0 && 
+        S_ISSOCK(st.st_mode)) {
+        unlink(path.data());
+    }
+    if (bind(fd, (struct sockaddr*)&addr, addr_len) < 0) {
+        close(fd);
+        throw runtime_error(strerror(errno));
+    }
+    return this->listen_to(fd);
+}
+
+int AsyncHttpServer::listen_to(const int& fd) {
+    if (!tune_socket(fd, this->socket_options, true) ||
+        listen(fd, this->backlog) < 0) {
+        close(fd);
+        throw runtime_error(strerror(errno));
+    } 
+    // set itself as the read handler for the socket
+    this->listeners.insert(fd);
+    this->loop->set_handler(fd, this);
+    return fd;
+}
+
+AsyncHttpServer::~AsyncHttpServer() {
+    vector<pair<string, HttpRequestHandler*> >::iterator it;
+    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
+        delete (*it).second;
+    }
+    map<int, HttpRequest*>::iterator it2;
+    for (it2 = this->requests.begin(); it2 != this->requests.end(); it2++) {
+        delete (*it2).second;
+    }
+    this->requests.clear();
+    map<int, Http2Connection*>::iterator it5;
+    for (it5 = this->h2_connections.begin(); it5 != this->h2_connections.end();
+        it5++) {
+        delete (*it5).second;
+    }
+    this->h2_connections.clear();
+    set<int>::iterator it3;
+    for (it3 = this->listeners.begin(); it3 != this->listeners.end(); it3++) {
+        this->loop->unset_handler(*it3);
+        close(*it3);
+    }
+    map<int, ssl_ctx_st*>::iterator it4;
+    for (it4 = this->tls_contexts.begin(); it4 != this->tls_contexts.end();
+        it4++) {
+        tls_free_context((*it4).second);
+    }
+    this->read_buffers.clear();
+    this->write_buffers.clear(); 
+    this->handlers.clear();
+}
+
+void AsyncHttpServer::add_handler(const string& pattern, 
+    HttpRequestHandler* const handler) {
+    this->handlers.push_back(make_pair(pattern, handler));
+}
+
+HttpRequestHandler* AsyncHttpServer::remove_handler(const string& pattern) {
+    HttpRequestHandler* removed = NULL;
+    vector<pair<string, HttpRequestHandler*> >::iterator it;
+    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
+        if ((*it).first.compare(pattern) == 0) {
+            this->handlers.erase(it);
+            removed = (*it).second;
+            break;
+        }
+    }
+    return removed;
+}
+
+void AsyncHttpServer::set_backlog(const int& backlog) {
+    // listening again on a listening socket only updates the backlog
+    set<int>::iterator it;
+    for (it = this->listeners.begin(); it != this->listeners.end(); it++) {
+        if (listen(*it, backlog) < 0) {
+            throw runtime_error(strerror(errno));
+        }
+    }
+    this->backlog = backlog;
+}
+
+void AsyncHttpServer::set_max_connections(const int& max) {
+    this->max_connections = max;
+}
+
+void AsyncHttpServer::set_socket_options(const SocketOptions& options) {
+    set<int>::iterator it;
+    for (it = this->listeners.begin(); it != this->listeners.end(); it++) {
+        if (!tune_socket(*it, options, true)) {
+            throw runtime_error(strerror(errno));
+        }
+    }
+    this->socket_options = options;
+}
+
+void AsyncHttpServer::set_max_in_flight(const string& pattern, 
+    const int& max) {
+    this->route_limits[pattern] = max;
+}
+
+void AsyncHttpServer::set_max_body_size(const string& pattern, 
+    const size_t& size) {
+    this->body_limits[pattern] = size;
+}
+
+void AsyncHttpServer::set_coalescing(const string& pattern, 
+    const bool& enabled, const vector<string>& headers) {
+    if (!enabled) {
+        this->coalesced.erase(pattern);
+        return;
+    }
+    vector<string>& names = this->coalesced[pattern];
+    names.clear();
+    for (size_t i = 0; i < headers.size(); i++) {
+        names.push_back(to_lower(headers[i]));
+    }
+}
+
+bool AsyncHttpServer::join(HttpRequest* const request, 
+    const string& pattern) {
+    if (request->method.compare("GET") != 0 || request->length > 0 ||
+        this->coalesced.count(pattern) == 0) {
+        return false;
+    }
+    const vector<string>& names = this->coalesced[pattern];
+    string key = request->method + " " + request->path;
+    for (size_t i = 0; i < names.size(); i++) {
+        key += "\n" + request->get_header(names[i]);
+    }
+    request->flight = key;
+    if (this->flights.count(key) == 0) {
+        // nobody waits yet, but the next ones will
+        this->flights[key];
+        request->leading = true;
+        return false;
+    }
+    request->deferred = true;
+    this->flights[key].push_back(request);
+    return true;
+}
+
+void AsyncHttpServer::land(HttpRequest* const request, const int& code,
+    const string& body) {
+    vector<HttpRequest*> followers;
+    followers.swap(this->flights[request->flight]);
+    this->flights.erase(request->flight);
+    request->flight.clear();
+    string sequence;
+    for (size_t i = 0; i < followers.size(); i++) {
+        HttpRequest* follower = followers[i];
+        follower->flight.clear();
+        follower->done = true;
+        if (follower->stream > 0) {
+            this->h2_connections[follower->fd]->respond(follower, code, body);
+            continue;
+        }
+        if (sequence.empty()) {
+            sequence = HttpResponse::to_sequence(code, body);
+        }
+        this->clear_buffers(follower->fd);
+        this->write_buffers[follower->fd] = sequence;
+        this->resume(follower->fd);
+    }
+}
+
+bool AsyncHttpServer::forsake(HttpRequest* const request) {
+    if (request->flight.empty()) {
+        return false;
+    }
+    vector<HttpRequest*>& followers = this->flights[request->flight];
+    if (!request->leading) {
+        followers.erase(find(followers.begin(), followers.end(), request));
+        delete request;
+        return true;
+    }
+    if (followers.empty()) {
+        this->flights.erase(request->flight);
+        request->flight.clear();
+        return false;
+    }
+    // the response is still awaited, respond() deletes the request then
+    request->fd = -1;
+    request->stream = 0;
+    return true;
+}
+
+void AsyncHttpServer::set_retry_after(const int& seconds) {
+    // serialize the 503 response once so shedding costs only a write
+    stringstream value;
+    value << seconds;
+    map<string, string> headers;
+    headers["Retry-After"] = value.str();
+    this->retry_after = seconds;
+    this->overload = HttpResponse::to_sequence(503, "", headers);
+}
+
+// HttpProxyHandler
+
+/**
+ * HttpProxyConnection keeps the state of a request being proxied.
+ */
+class HttpProxyConnection {
+    public:
+        enum Phase { REQUEST, RESPONSE_HEAD, RESPONSE };
+        Phase phase;
+        int client;
+        int upstream;
+        int pipe[2];
+        size_t piped;
+        bool splice;
+        bool replied;
+        size_t remaining;
+        string out;
+        string head;
+};
+
+static bool is_hop_by_hop(const string& name, const string& connection) {
+    static const char* names[] = {"connection", "keep-alive", 
+        "proxy-connection", "proxy-authenticate", "proxy-authorization", "te",
+        "trailer", "transfer-encoding", "upgrade", NULL};
+    for (int i = 0; names[i] != NULL; i++) {
+        if (name.compare(names[i]) == 0) {
+            return true;
+        }
+    }
+    // and the headers listed by Connection
+    stringstream tokens(to_lower(connection));
+    string token;
+    while (getline(tokens, token, ',')) {
+        size_t p0 = token.find_first_not_of(" \t");
+        size_t p1 = token.find_last_not_of(" \t");
+        if (p0 != string::npos && 
+            token.compare(p0, p1 - p0 + 1, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int flush_buffer(const int& fd, string& buffer) {
+    while (!buffer.empty()) {
+        ssize_t n = send(fd, buffer.data(), buffer.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            buffer.erase(0, n);
+        } else {
+            return (n < 0 && errno == EAGAIN) ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+static string rewrite_response_head(const string& head) {
+    // find Connection first as it may name more hop-by-hop headers
+    vector<pair<string, string> > lines;
+    string connection;
+    size_t p0 = head.find("\r\n");
+    for (size_t p1 = p0 + 2; p1 < head.size(); ) {
+        size_t p2 = head.find("\r\n", p1);
+        if (p2 == string::npos || p2 == p1) {
+            break;
+        }
+        size_t p3 = head.find(":", p1);
+        if (p3 != string::npos && p3 < p2) {
+            string name = to_lower(head.substr(p1, p3 - p1));
+            lines.push_back(make_pair(name, head.substr(p1, p2 - p1)));
+            if (name.compare("connection") == 0) {
+                connection += head.substr(p3 + 1, p2 - p3 - 1) + ",";
+            }
+        }
+        p1 = p2 + 2;
+    }
+    string rewritten = head.substr(0, p0 + 2);
+    for (size_t i = 0; i < lines.size(); i++) {
+        // the body is passed as is, so its transfer coding must stay
+        if (!is_hop_by_hop(lines[i].first, connection) || 
+            lines[i].first.compare("transfer-encoding") == 0) {
+            rewritten += lines[i].second + "\r\n";
+        }
+    }
+    return rewritten + "Via: 1.0 httpcpp\r\nConnection: close\r\n\r\n";
+}
+
+void HttpProxyHandler::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
+    string pending;
+    int client = this->detach(request, pending);
+    if (client < 0) {
+        return;
+    }
+    HttpProxyConnection* connection = new HttpProxyConnection();
+    connection->client = client;
+    connection->upstream = -1;
+    connection->phase = HttpProxyConnection::REQUEST;
+    connection->piped = 0;
+    connection->splice = true;
+    connection->replied = false;
+    if (pipe2(connection->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        connection->pipe[0] = connection->pipe[1] = -1;
+        connection->splice = false;
+    } else {
+        fcntl(connection->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    this->connections[connection->client] = connection;
+    // the head to forward, without hop-by-hop headers, naming the client
+    bool expect = request->get_version().compare("HTTP/1.1") == 0 &&
+        to_lower(request->get_header("Expect")).compare("100-continue") == 0;
+    string forwarded = request->get_header("X-Forwarded-For");
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    char address[INET6_ADDRSTRLEN];
+    if (getpeername(connection->client, (struct sockaddr*)&addr, 
+        &addr_len) == 0 && (addr.ss_family == AF_INET ||
+        addr.ss_family == AF_INET6)) {
+        inet_ntop(addr.ss_family, addr.ss_family == AF_INET ?
+            (void*)&((struct sockaddr_in*)&addr)->sin_addr :
+            (void*)&((struct sockaddr_in6*)&addr)->sin6_addr,
+            address, sizeof(address));
+        forwarded += (forwarded.empty() ? "" : ", ") + string(address);
+    }
+    stringstream head;
+    head << request->get_method() << " " << request->get_path() << 
+        " HTTP/1.0\r\n";
+    const map<string, string>& headers = request->get_headers();
+    const string& hop = request->get_header("Connection");
+    map<string, string>::const_iterator it;
+    for (it = headers.begin(); it != headers.end(); it++) {
+        if (!is_hop_by_hop((*it).first, hop) && 
+            (*it).first.compare("expect") != 0 &&
+            (*it).first.compare("x-forwarded-for") != 0) {
+            head << (*it).first << ": " << (*it).second << "\r\n";
+        }
+    }
+    if (!forwarded.empty()) {
+        head << "x-forwarded-for: " << forwarded << "\r\n";
+    }
+    head << "Via: 1.0 httpcpp\r\nConnection: close\r\n\r\n";
+    size_t length = request->get_length();
+    if (pending.size() > length) {
+        pending.resize(length);
+    }
+    connection->remaining = length - pending.size();
+    connection->out = head.str() + pending;
+    // connect to the next upstream, trying the others if it fails right away
+    for (size_t i = 0; i < this->upstreams.size(); i++) {
+        pair<string, int>& upstream = 
+            this->upstreams[this->next++ % this->upstreams.size()];
+        try {
+            connection->upstream = open_stream(upstream.first, 
+                upstream.second);
+            break;
+        } catch (runtime_error& e) {
+        }
+    }
+    if (connection->upstream < 0) {
+        this->finish(connection);
+        return;
+    }
+    this->connections[connection->upstream] = connection;
+    if (expect && pending.empty() && connection->remaining > 0) {
+        // the body is streamed, so ask for it right away
+        string interim = status_line(100) + "\r\n";
+        send(connection->client, interim.data(), interim.size(), 
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    this->loop->set_handler(connection->client, this);
+    this->loop->set_handler(connection->upstream, this, 'w');
+}
+
+void HttpProxyHandler::pump(HttpProxyConnection* const connection) {
+    int status = 0;
+    while (true) {
+        if (connection->phase == HttpProxyConnection::REQUEST) {
+            status = flush_buffer(connection->upstream, connection->out);
+            if (status == 0) {
+                status = this->transfer(connection, connection->client,
+                    connection->upstream, connection->remaining);
+            }
+            if (status != 0) {
+                break;
+            }
+            // the request is forwarded, wait for the response
+            connection->phase = HttpProxyConnection::RESPONSE_HEAD;
+            this->loop->unset_handler(connection->client);
+            this->loop->set_handler(connection->upstream, this);
+        } else if (connection->phase == HttpProxyConnection::RESPONSE_HEAD) {
+            char buffer[BUFFER_SIZE];
+            ssize_t n = recv(connection->upstream, buffer, BUFFER_SIZE, 0);
+            if (n <= 0) {
+                status = (n < 0 && errno == EAGAIN) ? 1 : -1;
+                break;
+            }
+            string& head = connection->head;
+            head.append(buffer, n);
+            size_t p = head.find("\r\n\r\n");
+            if (p == string::npos) {
+                if (head.size() > MAX_HEAD_SIZE) {
+                    status = -1;
+                    break;
+                }
+                continue;
+            }
+            // the rest of the buffer is the beginning of the body
+            connection->out = rewrite_response_head(head.substr(0, p + 4)) + 
+                head.substr(p + 4);
+            head.clear();
+            connection->phase = HttpProxyConnection::RESPONSE;
+            connection->replied = true;
+            connection->remaining = string::npos;
+            this->loop->set_handler(connection->client, this, 'w');
+        } else {
+            status = flush_buffer(connection->client, connection->out);
+            if (status == 0) {
+                status = this->transfer(connection, connection->upstream,
+                    connection->client, connection->remaining);
+            }
+            break;
+        }
+    }
+    if (status != 1) {
+        this->finish(connection);
+    }
+}
+
+int HttpProxyHandler::transfer(HttpProxyConnection* const connection,
+    const int& src, const int& dst, size_t& remaining) {
+    bool bounded = remaining != string::npos;
+    while (true) {
+        if (connection->splice) {
+            // from src into the pipe and from the pipe into dst, the bytes
+            // never leave the kernel
+            if (connection->piped > 0) {
+                ssize_t n = splice(connection->pipe[0], NULL, dst, NULL,
+                    connection->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    connection->piped -= n;
+                    continue;
+                }
+                return (n < 0 && errno == EAGAIN) ? 1 : -1;
+            }
+            if (remaining == 0) {
+                return 0;
+            }
+            size_t size = bounded ? min(remaining, (size_t)PIPE_SIZE) : 
+                PIPE_SIZE;
+            ssize_t n = splice(src, NULL, connection->pipe[1], NULL, size,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                connection->piped += n;
+                if (bounded) {
+                    remaining -= n;
+                }
+            } else if (n == 0) {
+                return bounded ? -1 : 0;
+            } else if (errno == EAGAIN) {
+                return 1;
+            } else if (errno == EINVAL) {
+                // splice() is not supported by the sockets, copy instead
+                connection->splice = false;
+            } else {
+                return -1;
+            }
+        } else {
+            int status = flush_buffer(dst, connection->out);
+            if (status != 0) {
+                return status;
+            }
+            if (remaining == 0) {
+                return 0;
+            }
+            char buffer[BUFFER_SIZE];
+            size_t size = bounded ? min(remaining, (size_t)BUFFER_SIZE) : 
+                BUFFER_SIZE;
+            ssize_t n = recv(src, buffer, size, 0);
+            if (n > 0) {
+                connection->out.append(buffer, n);
+                if (bounded) {
+                    remaining -= n;
+                }
+            } else if (n == 0) {
+                return bounded ? -1 : 0;
+            } else {
+                return errno == EAGAIN ? 1 : -1;
+            }
+        }
+    }
+}
+
+void HttpProxyHandler::finish(HttpProxyConnection* const connection) {
+    if (!connection->replied) {
+        string response = HttpResponse::to_sequence(502);
+        send(connection->client, response.data(), response.size(),
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    int fds[4] = {connection->client, connection->upstream, 
+        connection->pipe[0], connection->pipe[1]};
+    for (int i = 0; i < 4; i++) {
+        if (fds[i] >= 0) {
+            if (i < 2) {
+                this->connections.erase(fds[i]);
+                this->loop->unset_handler(fds[i]);
+            }
+            close(fds[i]);
+        }
+    }
+    delete connection;
+}
+
+void HttpProxyHandler::on_read(const int& fd) {
+    if (this->connections.count(fd) > 0) {
+        this->pump(this->connections[fd]);
+    }
+}
+
+void HttpProxyHandler::on_write(const int& fd) {
+    if (this->connections.count(fd) > 0) {
+        this->pump(this->connections[fd]);
+    }
+}
+
+void HttpProxyHandler::on_close(const int& fd) {
+    if (this->connections.count(fd) > 0) {
+        this->finish(this->connections[fd]);
+    } else {
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+HttpProxyHandler::HttpProxyHandler(const vector<string>& upstreams,
+    IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    this->next = 0;
+    for (size_t i = 0; i < upstreams.size(); i++) {
+        if (is_unix(upstreams[i])) {
+            this->upstreams.push_back(make_pair(upstreams[i], 0));
+            continue;
+        }
+        size_t p = upstreams[i].rfind(':');
+        if (p == string::npos) {
+            throw runtime_error("Invalid upstream " + upstreams[i]);
+        }
+        string address = upstreams[i].substr(0, p);
+        if (address.size() > 2 && address[0] == '[') {
+            address = address.substr(1, address.size() - 2);
+        }
+        this->upstreams.push_back(make_pair(address, 
+            atoi(upstreams[i].substr(p + 1).data())));
+    }
+}
+
+HttpProxyHandler::~HttpProxyHandler() {
+    while (!this->connections.empty()) {
+        HttpProxyConnection* connection = (*this->connections.begin()).second;
+        connection->replied = true;
+        this->finish(connection);
+    }
+}
+
+// WebSocketHandler
+
+/**
+ * WebSocketConnection keeps the state of a WebSocket connection.
+ */
+class WebSocketConnection {
+    public:
+        string message;
+        int opcode;
+        bool closing;
+        bool pinged;
+};
+
+static string sha1(const string& data) {
+    unsigned int h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 
+        0xc3d2e1f0};
+    // pad with 0x80, zeros and the length in bits up to 64-byte blocks
+    string padded = data + (char)0x80;
+    while (padded.size() % 64 != 56) {
+        padded += (char)0;
+    }
+    unsigned long long bits = (unsigned long long)data.size() * 8;
+    for (int i = 7; i >= 0; i--) {
+        padded += (char)((bits >> (i * 8)) & 0xff);
+    }
+    for (size_t block = 0; block < padded.size(); block += 64) {
+        unsigned int w[80];
+        for (int i = 0; i < 16; i++) {
+            const unsigned char* p = 
+                (const unsigned char*)padded.data() + block + i * 4;
+            w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            unsigned int x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+        unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            unsigned int f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            unsigned int t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    string digest;
+    for (int i = 0; i < 20; i++) {
+        digest += (char)((h[i / 4] >> (24 - (i % 4) * 8)) & 0xff);
+    }
+    return digest;
+}
+
+static string base64(const string& data) {
+    static const char* alphabet = 
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string encoded;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        unsigned int n = (unsigned char)data[i] << 16;
+        if (i + 1 < data.size()) {
+            n |= (unsigned char)data[i + 1] << 8;
+        }
+        if (i + 2 < data.size()) {
+            n |= (unsigned char)data[i + 2];
+        }
+        encoded += alphabet[(n >> 18) & 63];
+        encoded += alphabet[(n >> 12) & 63];
+        encoded += i + 1 < data.size() ? alphabet[(n >> 6) & 63] : '=';
+        encoded += i + 2 < data.size() ? alphabet[n & 63] : '=';
+    }
+    return encoded;
+}
+
+static void unmask(char* data, const size_t& size, const char* mask) {
+    size_t i = 0;
+    // the mask repeats every 4 bytes, so it is applied to 16 or 8 bytes at a
+    // time as long as the blocks start at multiples of 4
+#ifdef __SSE2__
+    int mask32;
+    memcpy(&mask32, mask, 4);
+    __m128i mask128 = _mm_set1_epi32(mask32);
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(block, mask128));
+    }
+#endif
+    unsigned long long mask64;
+    memcpy(&mask64, mask, 4);
+    memcpy((char*)&mask64 + 4, mask, 4);
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long block;
+        memcpy(&block, data + i, 8);
+        block ^= mask64;
+        memcpy(data + i, &block, 8);
+    }
+    for (; i < size; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+void WebSocketHandler::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
+    const string& key = request->get_header("Sec-WebSocket-Key");
+    if (request->get_method().compare("GET") != 0 || key.empty() ||
+        to_lower(request->get_header("Upgrade")).find("websocket") == 
+            string::npos ||
+        to_lower(request->get_header("Connection")).find("upgrade") == 
+            string::npos ||
+        request->get_header("Sec-WebSocket-Version").compare("13") != 0) {
+        this->reply(request, 400);
+        return;
+    }
+    string pending;
+    int fd = this->detach(request, pending);
+    if (fd < 0) {
+        return;
+    }
+    WebSocketConnection* connection = new WebSocketConnection();
+    connection->opcode = 0;
+    connection->closing = false;
+    connection->pinged = false;
+    this->connections[fd] = connection;
+    this->clear_buffers(fd);
+    this->read_buffers[fd] = pending;
+    this->write_buffers[fd] = 
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " + 
+        base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) + 
+        "\r\n\r\n";
+    // full duplex, the socket is watched for both directions from now on
+    this->loop->set_handler(fd, this, 'a');
+    this->on_open(fd, request);
+    if (this->connections.count(fd) > 0) {
+        this->parse(fd);
+    }
+}
+
+void WebSocketHandler::parse(const int& fd) {
+    string& buffer = this->read_buffers[fd];
+    size_t p = 0;
+    while (this->connections.count(fd) > 0) {
+        WebSocketConnection* connection = this->connections[fd];
+        const unsigned char* data = (const unsigned char*)buffer.data() + p;
+        size_t size = buffer.size() - p;
+        if (size < 2) {
+            break;
+        }
+        bool fin = (data[0] & 0x80) != 0;
+        int opcode = data[0] & 0x0f;
+        bool masked = (data[1] & 0x80) != 0;
+        unsigned long long length = data[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126) {
+            if (size < 4) {
+                break;
+            }
+            length = (data[2] << 8) | data[3];
+            header = 4;
+        } else if (length == 127) {
+            if (size < 10) {
+                break;
+            }
+            // the most significant bit must be 0
+            if (data[2] & 0x80) {
+                this->disconnect(fd, 1002);
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | data[2 + i];
+            }
+            header = 10;
+        }
+        // clients must mask their frames, and control frames are short and
+        // never fragmented
+        if (!masked || (data[0] & 0x70) != 0 || 
+            (opcode >= 0x8 && (length > 125 || !fin))) {
+            this->disconnect(fd, 1002);
+            break;
+        }
+        // compared without adding, which could wrap around, the message
+        // never being over the maximum
+        if (length > MAX_MESSAGE_SIZE - connection->message.size()) {
+            this->disconnect(fd, 1009);
+            break;
+        }
+        if (size < header + 4 || length > size - header - 4) {
+            break;
+        }
+        char* payload = &buffer[p + header + 4];
+        unmask(payload, length, (const char*)data + header);
+        string body(payload, length);
+        p += header + 4 + length;
+        if (opcode == 0x8) {
+            // close, answered by a close unless already closing
+            if (!connection->closing) {
+                connection->closing = true;
+                this->send_frame(fd, 0x8, body.substr(0, 2));
+            }
+            if (this->write_buffers[fd].empty()) {
+                this->drop(fd);
+            }
+            break;
+        } else if (opcode == 0x9) {
+            this->send_frame(fd, 0xa, body);
+        } else if (opcode == 0xa) {
+            connection->pinged = false;
+            this->on_pong(fd, body);
+        } else if (opcode == 0x1 || opcode == 0x2 || opcode == 0x0) {
+            // a message starts with text or binary, and continues with
+            // continuation frames
+            if ((opcode == 0x0) != (connection->opcode != 0)) {
+                this->disconnect(fd, 1002);
+                break;
+            }
+            if (opcode != 0x0) {
+                connection->opcode = opcode;
+            }
+            connection->message.append(body);
+            if (fin) {
+                string message;
+                message.swap(connection->message);
+                bool binary = connection->opcode == 0x2;
+                connection->opcode = 0;
+                if (!connection->closing) {
+                    this->on_message(fd, message, binary);
+                }
+            }
+        } else {
+            this->disconnect(fd, 1002);
+            break;
+        }
+    }
+    if (this->connections.count(fd) > 0) {
+        this->read_buffers[fd].erase(0, p);
+    }
+}
+
+void WebSocketHandler::send_frame(const int& fd, const int& opcode,
+    const string& payload, const bool& fin) {
+    if (this->connections.count(fd) == 0) {
+        return;
+    }
+    string frame;
+    frame += (char)((fin ? 0x80 : 0) | opcode);
+    if (payload.size() < 126) {
+        frame += (char)payload.size();
+    } else if (payload.size() < 65536) {
+        frame += (char)126;
+        frame += (char)(payload.size() >> 8);
+        frame += (char)(payload.size() & 0xff);
+    } else {
+        frame += (char)127;
+        for (int i = 7; i >= 0; i--) {
+            frame += (char)(((unsigned long long)payload.size() >> (i * 8)) & 
+                0xff);
+        }
+    }
+    string& buffer = this->write_buffers[fd];
+    buffer.reserve(buffer.size() + frame.size() + payload.size());
+    buffer.append(frame);
+    buffer.append(payload);
+    this->on_write(fd);
+}
+
+void WebSocketHandler::drop(const int& fd) {
+    if (this->connections.count(fd) == 0) {
+        return;
+    }
+    delete this->connections[fd];
+    this->connections.erase(fd);
+    this->clear_buffers(fd);
+    this->loop->unset_handler(fd);
+    this->on_disconnect(fd);
+    close(fd);
+}
+
+void WebSocketHandler::on_read(const int& fd) {
+    char buffer[BUFFER_SIZE];
+    while (this->connections.count(fd) > 0) {
+        ssize_t n = read(fd, buffer, BUFFER_SIZE);
+        if (n > 0) {
+            this->read_buffers[fd].append(buffer, n);
+        } else if (n == 0 || errno != EAGAIN) {
+            this->drop(fd);
+            return;
+        } else {
+            break;
+        }
+    }
+    this->parse(fd);
+}
+
+void WebSocketHandler::on_write(const int& fd) {
+    if (this->connections.count(fd) == 0) {
+        return;
+    }
+    string& buffer = this->write_buffers[fd];
+    int status = flush_buffer(fd, buffer);
+    if (status < 0) {
+        this->drop(fd);
+    } else if (status == 0 && this->connections[fd]->closing) {
+        // the close frame is out, wait for the client to close
+        shutdown(fd, SHUT_WR);
+    }
+}
+
+void WebSocketHandler::on_close(const int& fd) {
+    if (this->connections.count(fd) > 0) {
+        this->drop(fd);
+    } else {
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+void WebSocketHandler::on_timeout() {
+    // disconnect the clients that did not answer the last ping in time
+    vector<int> fds;
+    map<int, WebSocketConnection*>::iterator it;
+    for (it = this->connections.begin(); it != this->connections.end(); 
+        it++) {
+        fds.push_back((*it).first);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (this->connections.count(fds[i]) == 0) {
+            continue;
+        }
+        WebSocketConnection* connection = this->connections[fds[i]];
+        if (connection->pinged || connection->closing) {
+            this->drop(fds[i]);
+        } else {
+            connection->pinged = true;
+            this->send_frame(fds[i], 0x9, "");
+        }
+    }
+    this->timeout = this->loop->add_timeout(this->ping_interval, this);
+}
+
+WebSocketHandler::WebSocketHandler(IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    this->ping_interval = 0;
+    this->timeout = -1;
+}
+
+WebSocketHandler::~WebSocketHandler() {
+    if (this->timeout >= 0) {
+        this->loop->remove_timeout(this->timeout);
+    }
+    while (!this->connections.empty()) {
+        int fd = (*this->connections.begin()).first;
+        delete this->connections[fd];
+        this->connections.erase(fd);
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+void WebSocketHandler::send_message(const int& fd, const string& message,
+    const bool& binary, const size_t& fragment_size) {
+    int opcode = binary ? 0x2 : 0x1;
+    if (fragment_size == 0 || message.size() <= fragment_size) {
+        this->send_frame(fd, opcode, message);
+        return;
+    }
+    for (size_t p = 0; p < message.size(); p += fragment_size) {
+        bool fin = p + fragment_size >= message.size();
+        this->send_frame(fd, p == 0 ? opcode : 0x0, 
+            message.substr(p, fragment_size), fin);
+    }
+}
+
+void WebSocketHandler::send_ping(const int& fd, const string& payload) {
+    this->send_frame(fd, 0x9, payload.substr(0, 125));
+}
+
+void WebSocketHandler::disconnect(const int& fd, const int& code,
+    const string& reason) {
+    if (this->connections.count(fd) == 0 || 
+        this->connections[fd]->closing) {
+        return;
+    }
+    string payload;
+    payload += (char)(code >> 8);
+    payload += (char)(code & 0xff);
+    payload += reason.substr(0, 123);
+    this->connections[fd]->closing = true;
+    this->send_frame(fd, 0x8, payload);
+}
+
+void WebSocketHandler::set_ping_interval(const int& interval) {
+    if (this->timeout >= 0) {
+        this->loop->remove_timeout(this->timeout);
+        this->timeout = -1;
+    }
+    this->ping_interval = interval;
+    if (interval > 0) {
+        this->timeout = this->loop->add_timeout(interval, this);
+    }
+}
+
+// HttpEventHub
+
+/**
+ * HttpEventBuffer is an event serialized once for all the subscribers, which
+ * is deleted by the last one to write it out.
+ */
+class HttpEventBuffer {
+    public:
+        string data;
+        int references;
+        HttpEventBuffer(const string& data) : data(data) {
+            this->references = 1;
+        }
+        void unref() {
+            if (--this->references == 0) {
+                delete this;
+            }
+        }
+};
+
+/**
+ * HttpEventQueue keeps the events not written out yet to a subscriber.
+ */
+class HttpEventQueue {
+    public:
+        deque<HttpEventBuffer*> events;
+        // of the first event, written out already
+        size_t offset;
+        size_t size;
+        bool closing;
+        HttpEventQueue() {
+            this->offset = 0;
+            this->size = 0;
+            this->closing = false;
+        }
+        ~HttpEventQueue() {
+            for (size_t i = 0; i < this->events.size(); i++) {
+                this->events[i]->unref();
+            }
+        }
+};
+
+static string event_sequence(const string& data, const string& event,
+    const string& id) {
+    stringstream sequence;
+    if (!id.empty()) {
+        sequence << "id: " << id << "\n";
+    }
+    if (!event.empty()) {
+        sequence << "event: " << event << "\n";
+    }
+    // a line of data per line, the client joins them back with line feeds
+    size_t p = 0;
+    while (true) {
+        size_t q = data.find('\n', p);
+        size_t end = q == string::npos ? data.size() : q;
+        if (end > p && data[end - 1] == '\r') {
+            end--;
+        }
+        sequence << "data: " << data.substr(p, end - p) << "\n";
+        if (q == string::npos) {
+            break;
+        }
+        p = q + 1;
+    }
+    sequence << "\n";
+    return sequence.str();
+}
+
+void HttpEventHub::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
+    if (request->get_method().compare("GET") != 0) {
+        this->reply(request, 405);
+        return;
+    }
+    string pending;
+    int fd = this->detach(request, pending);
+    if (fd < 0) {
+        return;
+    }
+    this->subscribers[fd] = new HttpEventQueue();
+    this->loop->set_handler(fd, this, 'a');
+    // the body goes on until the connection is closed
+    HttpEventBuffer* head = new HttpEventBuffer(
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n\r\n");
+    this->queue(fd, head);
+    head->unref();
+    if (this->subscribers.count(fd) > 0) {
+        this->on_subscribe(fd, request);
+    }
+}
+
+void HttpEventHub::queue(const int& fd, HttpEventBuffer* const buffer) {
+    HttpEventQueue* queue = this->subscribers[fd];
+    if (queue->closing) {
+        return;
+    }
+    if (this->high_water > 0 && queue->size > 0 &&
+        queue->size + buffer->data.size() > this->high_water) {
+        // the subscriber does not keep up
+        if (this->disconnect_slow) {
+            this->drop(fd);
+        }
+        return;
+    }
+    buffer->references++;
+    queue->events.push_back(buffer);
+    queue->size += buffer->data.size();
+    if (queue->events.size() == 1) {
+        // otherwise the socket is full already, see on_write()
+        this->on_write(fd);
+    }
+}
+
+void HttpEventHub::drop(const int& fd) {
+    if (this->subscribers.count(fd) == 0) {
+        return;
+    }
+    delete this->subscribers[fd];
+    this->subscribers.erase(fd);
+    this->loop->unset_handler(fd);
+    this->on_unsubscribe(fd);
+    close(fd);
+}
+
+void HttpEventHub::on_read(const int& fd) {
+    // nothing is expected from the client but the end of the connection
+    char buffer[BUFFER_SIZE];
+    while (this->subscribers.count(fd) > 0) {
+        ssize_t n = read(fd, buffer, BUFFER_SIZE);
+        if (n == 0 || (n < 0 && errno != EAGAIN)) {
+            this->drop(fd);
+        } else if (n < 0) {
+            break;
+        }
+    }
+}
+
+void HttpEventHub::on_write(const int& fd) {
+    if (this->subscribers.count(fd) == 0) {
+        return;
+    }
+    HttpEventQueue* queue = this->subscribers[fd];
+    while (!queue->events.empty()) {
+        // the events queued go out together, as they are
+        struct iovec pieces[64];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = pieces;
+        for (size_t i = 0; i < queue->events.size() && i < 64; i++) {
+            const string& data = queue->events[i]->data;
+            size_t offset = i == 0 ? queue->offset : 0;
+            pieces[i].iov_base = (void*)(data.data() + offset);
+            pieces[i].iov_len = data.size() - offset;
+            message.msg_iovlen++;
+        }
+        ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN) {
+                this->drop(fd);
+            }
+            return;
+        }
+        queue->size -= n;
+        size_t written = n + queue->offset;
+        while (!queue->events.empty() && 
+            written >= queue->events.front()->data.size()) {
+            written -= queue->events.front()->data.size();
+            queue->events.front()->unref();
+            queue->events.pop_front();
+        }
+        queue->offset = written;
+    }
+    if (queue->closing) {
+        this->drop(fd);
+    }
+}
+
+void HttpEventHub::on_close(const int& fd) {
+    if (this->subscribers.count(fd) > 0) {
+        this->drop(fd);
+    } else {
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+HttpEventHub::HttpEventHub(IOLoop* const loop) {
+    // set the IO loop
+    if (loop == NULL) {
+        this->loop = IOLoop::instance();
+    } else {
+        this->loop = loop;
+    }
+    this->high_water = EVENT_HIGH_WATER;
+    this->disconnect_slow = false;
+}
+
+HttpEventHub::~HttpEventHub() {
+    while (!this->subscribers.empty()) {
+        int fd = (*this->subscribers.begin()).first;
+        delete this->subscribers[fd];
+        this->subscribers.erase(fd);
+        this->loop->unset_handler(fd);
+        close(fd);
+    }
+}
+
+void HttpEventHub::publish(const string& data, const string& event,
+    const string& id) {
+    HttpEventBuffer* buffer = new HttpEventBuffer(event_sequence(data, event,
+        id));
+    // subscribers may be dropped on the way
+    vector<int> fds;
+    map<int, HttpEventQueue*>::iterator it;
+    for (it = this->subscribers.begin(); it != this->subscribers.end(); 
+        it++) {
+        fds.push_back((*it).first);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (this->subscribers.count(fds[i]) > 0) {
+            this->queue(fds[i], buffer);
+        }
+    }
+    buffer->unref();
+}
+
+void HttpEventHub::send(const int& fd, const string& data, 
+    const string& event, const string& id) {
+    if (this->subscribers.count(fd) == 0) {
+        return;
+    }
+    HttpEventBuffer* buffer = new HttpEventBuffer(event_sequence(data, event,
+        id));
+    this->queue(fd, buffer);
+    buffer->unref();
+}
+
+void HttpEventHub::disconnect(const int& fd) {
+    if (this->subscribers.count(fd) == 0) {
+        return;
+    }
+    this->subscribers[fd]->closing = true;
+    if (this->subscribers[fd]->events.empty()) {
+        this->drop(fd);
+    }
+}
+
+size_t HttpEventHub::size() {
+    return this->subscribers.size();
+}
+
+void HttpEventHub::set_high_water_mark(const size_t& bytes, 
+    const bool& disconnect) {
+    this->high_water = bytes;
+    this->disconnect_slow = disconnect;
+}
+
+// HttpTraceHandler
+
+void HttpTraceHandler::get(HttpRequest* const request, 
+    const vector<string>& args) {
+    // handlers run on the loop of their server
+    this->reply(request, 200, IOLoop::current()->dump_trace());
+}
+
+// HttpFormPart
+
+static bool write_all(const int& fd, const char* data, const size_t& size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+HttpFormPart::HttpFormPart() {
+    this->fd = -1;
+    this->size = 0;
+}
+
+HttpFormPart::~HttpFormPart() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+const string& HttpFormPart::get_name() {
+    return this->name;
+}
+
+const string& HttpFormPart::get_filename() {
+    return this->filename;
+}
+
+const string& HttpFormPart::get_header(const string& name) {
+    static const string none;
+    map<string, string>::const_iterator it = this->headers.find(to_lower(name));
+    return it == this->headers.end() ? none : (*it).second;
+}
+
+const map<string, string>& HttpFormPart::get_headers() {
+    return this->headers;
+}
+
+const size_t& HttpFormPart::get_size() {
+    return this->size;
+}
+
+const string& HttpFormPart::get_value() {
+    return this->value;
+}
+
+int HttpFormPart::get_fd() {
+    return this->fd;
+}
+
+bool HttpFormPart::save(const string& path) {
+    if (this->fd >= 0) {
+        // an anonymous file gets a name without being copied
+        stringstream link;
+        link << "/proc/self/fd/" << this->fd;
+        if (linkat(AT_FDCWD, link.str().data(), AT_FDCWD, path.data(), 
+            AT_SYMLINK_FOLLOW) == 0) {
+            return true;
+        } else if (errno != EXDEV && errno != ENOENT) {
+            return false;
+        }
+    }
+    // otherwise copied, by the kernel from another file system
+    int out = open(path.data(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 
+        0600);
+    if (out < 0) {
+        return false;
+    }
+    bool copied = true;
+    if (this->fd < 0) {
+        copied = write_all(out, this->value.data(), this->value.size());
+    } else {
+        off_t offset = 0;
+        while (copied && (size_t)offset < this->size) {
+            copied = sendfile(out, this->fd, &offset, 
+                this->size - offset) > 0;
+        }
+    }
+    int error = errno;
+    close(out);
+    if (!copied) {
+        unlink(path.data());
+        errno = error;
+    }
+    return copied;
+}
+
+// HttpMultipartHandler
+
+/**
+ * HttpMultipartForm is the state of the parsing of a multipart body.
+ */
+class HttpMultipartForm {
+    public:
+        enum Phase { PREAMBLE, DELIMITER, HEAD, CONTENT, EPILOGUE };
+        Phase phase;
+        // the line break before a delimiter belongs to it
+        string delimiter;
+        // what is not parsed yet, at most a head or the length of a delimiter
+        string pending;
+        vector<HttpFormPart*> parts;
+        // the contents of the complete parts kept in memory
+        size_t memory;
+        HttpMultipartForm(const string& boundary) {
+            this->phase = PREAMBLE;
+            this->memory = 0;
+            this->delimiter = "\r\n--" + boundary;
+            // so that a body starting with a delimiter is no special case
+            this->pending = "\r\n";
+        }
+        ~HttpMultipartForm() {
+            for (size_t i = 0; i < this->parts.size(); i++) {
+                delete this->parts[i];
             }
+        }
+};
+
+static string header_parameter(const string& value, const string& name) {
+    // e.g. the boundary of multipart/form-data; boundary="xyz"
+    size_t p = value.find(';');
+    while (p != string::npos) {
+        size_t p1 = value.find_first_not_of(" \t", p + 1);
+        size_t p2 = value.find('=', p1);
+        if (p1 == string::npos || p2 == string::npos) {
             break;
         }
+        size_t p3 = value.find_last_not_of(" \t", p2 - 1);
+        string key = to_lower(value.substr(p1, p3 + 1 - p1));
+        string found;
+        p = p2 + 1;
+        if (p < value.size() && value[p] == '"') {
+            // browsers escape quotes in names as %22, backslashes are kept
+            size_t p4 = value.find('"', p + 1);
+            found = value.substr(p + 1, p4 == string::npos ? string::npos :
+                p4 - p - 1);
+            p = p4 == string::npos ? p4 : value.find(';', p4);
+        } else {
+            size_t p4 = value.find(';', p);
+            found = value.substr(p, p4 == string::npos ? string::npos : 
+                p4 - p);
+            size_t p5 = found.find_last_not_of(" \t");
+            found.erase(p5 == string::npos ? 0 : p5 + 1);
+            p = p4;
+        }
+        if (key.compare(name) == 0) {
+            return found;
+        }
     }
-    if (done || error) {
-        this->on_close(fd);
+    return "";
+}
+
+static int spool_file(const string& dir) {
+    // anonymous from the start, or unlinked right away where not supported
+    int fd = open(dir.data(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+        return fd;
     }
-    if (error) {
-        throw runtime_error("AsyncHttpServer write error");
+    string path = dir + "/httpcpp-XXXXXX";
+    if ((fd = mkostemp(&path[0], O_CLOEXEC)) >= 0) {
+        unlink(path.data());
     }
+    return fd;
 }
 
-void AsyncHttpServer::on_close(const int& fd) {
-    this->clear_buffers(fd);
-    this->loop->unset_handler(fd);
-    close(fd);
+HttpMultipartHandler::HttpMultipartHandler(const size_t& memory_limit, 
+    const string& spool_dir, const size_t& max_parts) {
+    this->memory_limit = memory_limit;
+    this->spool_dir = spool_dir;
+    this->max_parts = max_parts;
 }
 
-AsyncHttpServer::AsyncHttpServer(const int& port, IOLoop* const loop) {
-    // set the IO loop
-    if (loop == NULL) {
-        this->loop = IOLoop::instance();
-    } else {
-        this->loop = loop;
+HttpMultipartHandler::~HttpMultipartHandler() {
+    map<HttpRequest*, HttpMultipartForm*>::iterator it;
+    for (it = this->forms.begin(); it != this->forms.end(); it++) {
+        delete (*it).second;
     }
-    // create a socket, bind and listen to the port
-    if ((this->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        throw runtime_error(strerror(errno));
+}
+
+void HttpMultipartHandler::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
+    const string& type = request->get_header("Content-Type");
+    size_t p = type.find_first_of("; \t");
+    if (to_lower(type.substr(0, p)).compare("multipart/form-data") != 0) {
+        this->reply(request, 415);
+        return;
     }
-    int opt = 1;
-    if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        throw runtime_error(strerror(errno));
+    string boundary = header_parameter(type, "boundary");
+    if (boundary.empty() || boundary.size() > 70) {
+        this->reply(request, 400);
+        return;
     }
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (bind(this->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        throw runtime_error(strerror(errno));
+    // the parts may be spooled for a while, and the client may go meanwhile
+    this->defer(request);
+    this->forms[request] = new HttpMultipartForm(boundary);
+}
+
+void HttpMultipartHandler::on_body_chunk(HttpRequest* const request, 
+    const char* data, const size_t& size) {
+    if (this->forms.count(request) == 0) {
+        return;
+    }
+    int code = this->parse(request, this->forms[request], data, size);
+    if (code != 0 || request->done) {
+        this->drop(request);
+    }
+    if (code != 0 && !request->done) {
+        this->reply(request, code);
     }
-    if (listen(this->fd, LISTEN_BACKLOG) < 0) {
-        throw runtime_error(strerror(errno));
-    } 
-    // set itself as the read handler for the socket
-    this->loop->set_handler(this->fd, this);
 }
 
-AsyncHttpServer::~AsyncHttpServer() {
-    vector<pair<string, HttpRequestHandler*> >::iterator it;
-    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
-        delete (*it).second;
+void HttpMultipartHandler::on_body_end(HttpRequest* const request,
+    const vector<string>& args) {
+    if (this->forms.count(request) == 0) {
+        return;
     }
-    this->read_buffers.clear();
-    this->write_buffers.clear(); 
-    this->handlers.clear();
+    HttpMultipartForm* form = this->forms[request];
+    if (form->phase != HttpMultipartForm::EPILOGUE) {
+        // cut short before the closing delimiter
+        this->drop(request);
+        this->reply(request, 400);
+        return;
+    }
+    this->forms.erase(request);
+    this->on_form(request, form->parts);
+    delete form;
 }
 
-void AsyncHttpServer::add_handler(const string& pattern, 
-    HttpRequestHandler* const handler) {
-    this->handlers.push_back(make_pair(pattern, handler));
+void HttpMultipartHandler::on_abort(HttpRequest* const request) {
+    if (this->forms.count(request) > 0) {
+        this->drop(request);
+        // only deletes the request
+        this->reply(request, 500);
+    }
 }
 
-HttpRequestHandler* AsyncHttpServer::remove_handler(const string& pattern) {
-    HttpRequestHandler* removed = NULL;
-    vector<pair<string, HttpRequestHandler*> >::iterator it;
-    for (it = this->handlers.begin(); it != this->handlers.end(); it++) {
-        if ((*it).first.compare(pattern) == 0) {
-            this->handlers.erase(it);
-            removed = (*it).second;
+void HttpMultipartHandler::on_form(HttpRequest* const request, 
+    const vector<HttpFormPart*>& parts) {
+    this->reply(request, 405);
+}
+
+int HttpMultipartHandler::parse(HttpRequest* const request, 
+    HttpMultipartForm* const form, const char* data, const size_t& size) {
+    string& pending = form->pending;
+    const string& delimiter = form->delimiter;
+    pending.append(data, size);
+    // parsed up to p, erased once at the end
+    size_t p = 0;
+    while (true) {
+        if (form->phase == HttpMultipartForm::PREAMBLE ||
+            form->phase == HttpMultipartForm::CONTENT) {
+            // the end of the pending bytes may be the start of a delimiter
+            size_t q = pending.find(delimiter, p);
+            size_t end = q;
+            if (q == string::npos) {
+                end = pending.size() + 1 > delimiter.size() ? 
+                    pending.size() + 1 - delimiter.size() : 0;
+                end = max(end, p);
+            }
+            if (form->phase == HttpMultipartForm::CONTENT && end > p && 
+                !this->store(form, pending.data() + p, end - p)) {
+                return 500;
+            }
+            p = end;
+            if (q == string::npos) {
+                break;
+            }
+            if (form->phase == HttpMultipartForm::CONTENT) {
+                // the rest of a spooled part goes out, to be read back
+                HttpFormPart* part = form->parts.back();
+                if (part->fd >= 0 && (!write_all(part->fd, part->value.data(), 
+                    part->value.size()) || lseek(part->fd, 0, SEEK_SET) < 0)) {
+                    return 500;
+                }
+                if (part->fd >= 0) {
+                    string().swap(part->value);
+                } else {
+                    form->memory += part->value.size();
+                }
+            }
+            p += delimiter.size();
+            form->phase = HttpMultipartForm::DELIMITER;
+        } else if (form->phase == HttpMultipartForm::DELIMITER) {
+            // the delimiter is followed by padding and a line break, or by
+            // two dashes if it is the last one
+            p = min(pending.find_first_not_of(" \t", p), pending.size());
+            if (pending.size() - p < 2) {
+                break;
+            } else if (pending.compare(p, 2, "--") == 0) {
+                form->phase = HttpMultipartForm::EPILOGUE;
+            } else if (pending.compare(p, 2, "\r\n") == 0) {
+                // the line break is the one before the first header
+                form->phase = HttpMultipartForm::HEAD;
+            } else {
+                return 400;
+            }
+        } else if (form->phase == HttpMultipartForm::HEAD) {
+            size_t q = pending.find("\r\n\r\n", p);
+            if (q == string::npos) {
+                if (pending.size() - p > MAX_HEAD_SIZE) {
+                    return 400;
+                }
+                break;
+            }
+            if (form->parts.size() >= this->max_parts) {
+                return 413;
+            }
+            HttpFormPart* part = new HttpFormPart();
+            form->parts.push_back(part);
+            for (size_t p1 = p + 2; p1 < q + 2; ) {
+                size_t p2 = pending.find("\r\n", p1);
+                size_t p3 = pending.find(":", p1);
+                if (p3 != string::npos && p3 < p2) {
+                    size_t p4 = pending.find_first_not_of(" \t", p3 + 1);
+                    size_t p5 = pending.find_last_not_of(" \t", p2 - 1);
+                    string name = to_lower(pending.substr(p1, p3 - p1));
+                    string value;
+                    if (p4 < p2 && p5 >= p4) {
+                        value = pending.substr(p4, p5 - p4 + 1);
+                    }
+                    part->headers[name] = value;
+                }
+                p1 = p2 + 2;
+            }
+            const string& disposition = part->get_header(
+                "Content-Disposition");
+            part->name = header_parameter(disposition, "name");
+            part->filename = header_parameter(disposition, "filename");
+            p = q + 4;
+            form->phase = HttpMultipartForm::CONTENT;
+            this->on_part(request, part);
+            if (request->done) {
+                return 0;
+            }
+        } else {
+            // the epilogue is ignored
+            p = pending.size();
             break;
         }
     }
-    return removed;
+    pending.erase(0, p);
+    return 0;
+}
+
+bool HttpMultipartHandler::store(HttpMultipartForm* const form, 
+    const char* data, const size_t& size) {
+    // the parts in memory and the one being read share the limit, and once
+    // spooled, the value buffers the writes to the file
+    HttpFormPart* part = form->parts.back();
+    part->size += size;
+    part->value.append(data, size);
+    if (form->memory + part->value.size() <= this->memory_limit) {
+        return true;
+    }
+    if (part->fd < 0 && (part->fd = spool_file(this->spool_dir)) < 0) {
+        return false;
+    }
+    bool written = write_all(part->fd, part->value.data(), 
+        part->value.size());
+    part->value.clear();
+    return written;
+}
+
+void HttpMultipartHandler::drop(HttpRequest* const request) {
+    if (this->forms.count(request) > 0) {
+        delete this->forms[request];
+        this->forms.erase(request);
+    }
 }
 
 // IOLoop
 
 IOLoop* IOLoop::loop = new IOLoop();
 
+// the loop started on this thread, see IOLoop::current()
+static __thread IOLoop* running = NULL;
+
+/**
+ * IOBlock is the header of the memory allocated by IOLoop::allocate(), which
+ * keeps the alignment of operator new.
+ */
+union IOBlock {
+    struct {
+        IOLoop* loop;
+        size_t index;
+    } owner;
+    void* next;
+    // the widest of the fundamental types
+    long double align;
+};
+
+/**
+ * IOTraceSlot holds an event of the trace ring of IOLoop, read and written
+ * with the relaxed atomic builtins of the compiler, and stamped with a
+ * sequence number, the index of the event plus one, or 0 while it is being
+ * written, so that dump_trace() can tell a torn copy.
+ */
+class IOTraceSlot {
+    public:
+        unsigned long sequence;
+        const char* name;
+        int fd;
+        int stream;
+        long long start;
+        long long duration;
+        IOTraceSlot() : sequence(0), name(NULL), fd(0), stream(0), start(0), 
+            duration(0) {}
+};
+
 IOLoop::IOLoop() {
     this->fd = epoll_create(EPOLL_SIZE);
+    this->next_timeout = 0;
+    this->trace_rate = 0;
+    this->trace_seed = 88172645463325252ULL;
+    this->trace_ring = NULL;
+    this->trace_next = 0;
+    this->busy_poll = 0;
+    this->socket_poll = 0;
+    memset(&this->stats, 0, sizeof(this->stats));
+    this->pool.assign(MAX_POOLED_SIZE / POOL_GRANULE + 1, NULL);
+    this->pool_sizes.assign(this->pool.size(), 0);
 }
 
 IOHandler* IOLoop::set_handler(const int& fd, IOHandler* const handler, 
@@ -546,9 +5919,23 @@ IOHandler* IOLoop::set_handler(const int& fd, IOHandler* const handler,
     event.data.fd = fd;
     if (mode == 'r') {
         event.events = EPOLLIN | EPOLLET;
+    } else if (mode == 'a') {
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
     } else {
         event.events = EPOLLOUT | EPOLLET;
     }
+    // let the kernel busy poll the device of new sockets, which fails with
+    // ENOTSOCK for pipes and the like and EPERM without CAP_NET_ADMIN for
+    // more than net.core.busy_read, both of which are left to interrupts
+    if (this->socket_poll > 0 && this->handlers.count(fd) == 0) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &this->socket_poll, 
+            sizeof(this->socket_poll));
+#ifdef SO_PREFER_BUSY_POLL
+        int prefer = 1;
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, 
+            sizeof(prefer));
+#endif
+    }
     // unset the previous handler if any and set the new one 
     IOHandler* previous = this->unset_handler(fd);
     if (epoll_ctl(this->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
@@ -573,28 +5960,292 @@ IOHandler* IOLoop::unset_handler(const int& fd) {
     }
 } 
 
+int IOLoop::add_timeout(const int& delay, TimeoutHandler* const handler) {
+    int id = ++this->next_timeout;
+    long long deadline = IOLoop::now() + delay;
+    this->timeouts[make_pair(deadline, id)] = handler;
+    this->deadlines[id] = deadline;
+    return id;
+}
+
+bool IOLoop::remove_timeout(const int& id) {
+    if (this->deadlines.count(id) == 0) {
+        return false;
+    }
+    this->timeouts.erase(make_pair(this->deadlines[id], id));
+    this->deadlines.erase(id);
+    return true;
+}
+
+long long IOLoop::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long IOLoop::micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void IOLoop::set_trace_sampling(const int& rate) {
+    this->trace_rate = rate;
+    // allocated once and never freed, readers may be copying from it
+    if (rate > 0 && 
+        __atomic_load_n(&this->trace_ring, __ATOMIC_ACQUIRE) == NULL) {
+        IOTraceSlot* ring = new IOTraceSlot[TRACE_RING_SIZE];
+        IOTraceSlot* empty = NULL;
+        if (!__atomic_compare_exchange_n(&this->trace_ring, &empty, ring, 
+            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            delete[] ring;
+        }
+    }
+}
+
+bool IOLoop::sample() {
+    if (this->trace_rate <= 0) {
+        return false;
+    }
+    // at random rather than every rate-th, which could always pick the same
+    // kind of request, with xorshift64
+    this->trace_seed ^= this->trace_seed << 13;
+    this->trace_seed ^= this->trace_seed >> 7;
+    this->trace_seed ^= this->trace_seed << 17;
+    return this->trace_seed % this->trace_rate == 0;
+}
+
+void IOLoop::trace(const char* name, const int& fd, const int& stream,
+    const long long& start, const long long& duration) {
+    IOTraceSlot* ring = __atomic_load_n(&this->trace_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        return;
+    }
+    unsigned long next = __atomic_load_n(&this->trace_next, __ATOMIC_RELAXED);
+    IOTraceSlot& slot = ring[next % TRACE_RING_SIZE];
+    // readers leave the slot out until it is stamped again
+    __atomic_store_n(&slot.sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot.name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.fd, fd, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.stream, stream, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.duration, duration, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot.sequence, next + 1, __ATOMIC_RELEASE);
+    // publish the event to dump_trace()
+    __atomic_store_n(&this->trace_next, next + 1, __ATOMIC_RELEASE);
+}
+
+string IOLoop::dump_trace() {
+    vector<IOTraceEvent> events;
+    IOTraceSlot* ring = __atomic_load_n(&this->trace_ring, __ATOMIC_ACQUIRE);
+    unsigned long end = __atomic_load_n(&this->trace_next, __ATOMIC_ACQUIRE);
+    unsigned long begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    for (unsigned long i = begin; ring != NULL && i < end; i++) {
+        IOTraceSlot& slot = ring[i % TRACE_RING_SIZE];
+        unsigned long sequence = __atomic_load_n(&slot.sequence, 
+            __ATOMIC_ACQUIRE);
+        IOTraceEvent event;
+        event.name = __atomic_load_n(&slot.name, __ATOMIC_RELAXED);
+        event.fd = __atomic_load_n(&slot.fd, __ATOMIC_RELAXED);
+        event.stream = __atomic_load_n(&slot.stream, __ATOMIC_RELAXED);
+        event.start = __atomic_load_n(&slot.start, __ATOMIC_RELAXED);
+        event.duration = __atomic_load_n(&slot.duration, __ATOMIC_RELAXED);
+        // the copy is intact if the slot held the i-th event throughout,
+        // neither overwritten nor being overwritten meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (sequence == i + 1 && 
+            __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED) == sequence) {
+            events.push_back(event);
+        }
+    }
+    stringstream json;
+    json << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+        const IOTraceEvent& event = events[i];
+        json << (i > 0 ? "," : "") << "{\"name\":\"" << event.name << 
+            "\",\"cat\":\"http\",\"pid\":" << getpid() << ",\"tid\":" << 
+            event.fd << ",\"ts\":" << event.start;
+        if (event.duration < 0) {
+            json << ",\"ph\":\"i\",\"s\":\"t\"";
+        } else {
+            json << ",\"ph\":\"X\",\"dur\":" << event.duration;
+        }
+        if (event.stream > 0) {
+            json << ",\"args\":{\"stream\":" << event.stream << "}";
+        }
+        json << "}";
+    }
+    json << "],\"displayTimeUnit\":\"ms\"}";
+    return json.str();
+}
+
+void IOLoop::set_busy_poll(const int& budget, const int& socket_poll) {
+    this->busy_poll = max(budget, 0);
+    this->socket_poll = max(socket_poll, 0);
+    this->stats.spin = this->busy_poll;
+}
+
+IOLoopStats IOLoop::get_stats() {
+    return this->stats;
+}
+
+int IOLoop::wait(struct epoll_event* const events, const int& timeout) {
+    int n;
+    int remaining = timeout;
+    if (this->busy_poll > 0 && timeout != 0) {
+        long long start = IOLoop::micros();
+        long long now = start;
+        // never spin past the next timeout
+        long long end = start + this->stats.spin;
+        if (timeout > 0) {
+            end = min(end, start + (long long)timeout * 1000);
+        }
+        while (now < end) {
+            n = epoll_wait(this->fd, events, MAX_EVENTS, 0);
+            this->stats.polls++;
+            now = IOLoop::micros();
+            if (n != 0) {
+                this->stats.spin_time += now - start;
+                if (n > 0) {
+                    this->stats.hits++;
+                    this->stats.events += n;
+                    this->stats.spun_events += n;
+                }
+                return n;
+            }
+        }
+        this->stats.spin_time += now - start;
+        if (now > start) {
+            this->stats.misses++;
+        }
+        if (timeout > 0) {
+            remaining = max(0, timeout - (int)((now - start) / 1000));
+        }
+        // block, then adapt: events that came soon after blocking would have
+        // been caught by spinning longer, a long idle spell was spun in vain
+        n = epoll_wait(this->fd, events, MAX_EVENTS, remaining);
+        this->stats.waits++;
+        long long blocked = IOLoop::micros() - now;
+        if (n > 0 && blocked <= this->busy_poll) {
+            this->stats.spin = min(this->busy_poll, 
+                max(this->stats.spin * 2, max(this->busy_poll / 16, 1)));
+        } else if (n >= 0) {
+            this->stats.spin /= 2;
+        }
+    } else {
+        n = epoll_wait(this->fd, events, MAX_EVENTS, remaining);
+        this->stats.waits++;
+    }
+    if (n > 0) {
+        this->stats.events += n;
+    }
+    return n;
+}
+
+int IOLoop::run_timeouts() {
+    while (!this->timeouts.empty()) {
+        long long now = IOLoop::now();
+        map<pair<long long, int>, TimeoutHandler*>::iterator it = 
+            this->timeouts.begin();
+        if ((*it).first.first > now) {
+            return (int)((*it).first.first - now);
+        }
+        // unschedule before calling as the handler may schedule again
+        TimeoutHandler* handler = (*it).second;
+        this->deadlines.erase((*it).first.second);
+        this->timeouts.erase(it);
+        handler->on_timeout();
+    }
+    return -1;
+}
+
+void* IOLoop::allocate(const size_t& size) {
+    // blocks are recycled per multiple of the granule, from free lists
+    // threaded through the blocks themselves
+    size_t index = (size + POOL_GRANULE - 1) / POOL_GRANULE;
+    IOBlock* block;
+    if (index < this->pool.size() && this->pool[index] != NULL) {
+        block = (IOBlock*)this->pool[index];
+        this->pool[index] = block->next;
+        this->pool_sizes[index]--;
+    } else if (index < this->pool.size()) {
+        block = (IOBlock*)::operator new(sizeof(IOBlock) + 
+            index * POOL_GRANULE);
+    } else {
+        block = (IOBlock*)::operator new(sizeof(IOBlock) + size);
+    }
+    block->owner.loop = this;
+    block->owner.index = index;
+    return block + 1;
+}
+
+void IOLoop::release(void* const memory) {
+    IOBlock* block = (IOBlock*)memory - 1;
+    IOLoop* loop = block->owner.loop;
+    size_t index = block->owner.index;
+    if (index < loop->pool.size() && 
+        loop->pool_sizes[index] < MAX_POOLED_BLOCKS) {
+        block->next = loop->pool[index];
+        loop->pool[index] = block;
+        loop->pool_sizes[index]++;
+    } else {
+        ::operator delete(block);
+    }
+}
+
+IOLoop* IOLoop::current() {
+    return running != NULL ? running : IOLoop::instance();
+}
+
 void IOLoop::start() {
     // at the moment run forever unless an error occurs
+    running = this;
     struct epoll_event* events = (struct epoll_event*)malloc(
         sizeof(struct epoll_event) * MAX_EVENTS);
     while (true) {
         int n;
-        if ((n = epoll_wait(this->fd, events, MAX_EVENTS, -1)) < 0) {
+        int timeout = this->run_timeouts();
+        if ((n = this->wait(events, timeout)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             throw runtime_error(strerror(errno));
         }
         for (int i = 0; i < n; i++) {
             int fd = events[i].data.fd;
-            if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
-                this->handlers[fd]->on_close(fd);
-                this->unset_handler(fd);
-                close(fd);
-            } 
-            else if (events[i].events & EPOLLOUT) {
-                this->handlers[fd]->on_write(fd);
+            if (this->handlers.count(fd) == 0) {
+                // unset by a handler called earlier in this round
+                continue;
+            }
+            IOHandler* handler = this->handlers[fd];
+            if ((events[i].events & EPOLLHUP) && (events[i].events & EPOLLIN)
+                && !(events[i].events & EPOLLERR)) {
+                // the peer is gone but what it sent before is still to read,
+                // e.g. the response on a Unix domain socket
+                handler->on_read(fd);
+                if (this->handlers.count(fd) > 0 && 
+                    this->handlers[fd] == handler) {
+                    handler->on_close(fd);
+                }
             }
-            else if (events[i].events & EPOLLIN) {
-                this->handlers[fd]->on_read(fd);
+            else if ((events[i].events & EPOLLERR) || 
+                (events[i].events & EPOLLHUP)) {
+                // the handler unsets and closes the file descriptor itself,
+                // which may already be reused when on_close() returns
+                handler->on_close(fd);
             } 
+            else {
+                if (events[i].events & EPOLLOUT) {
+                    handler->on_write(fd);
+                }
+                // both are set only for handlers set with mode 'a'
+                if ((events[i].events & EPOLLIN) && 
+                    this->handlers.count(fd) > 0 && 
+                    this->handlers[fd] == handler) {
+                    handler->on_read(fd);
+                } 
+            }
         }
     }
 }
@@ -602,3 +6253,197 @@ void IOLoop::start() {
 IOLoop* IOLoop::instance() {
     return IOLoop::loop;
 }
+
+#if __cplusplus >= 202002L
+
+// IOTask
+
+void* IOTask::promise_type::operator new(size_t size) {
+    return IOLoop::current()->allocate(size);
+}
+
+void IOTask::promise_type::operator delete(void* frame) {
+    IOLoop::release(frame);
+}
+
+// HttpCoroutine
+
+void* HttpCoroutine::promise_type::operator new(size_t size) {
+    return IOLoop::current()->allocate(size);
+}
+
+void HttpCoroutine::promise_type::operator delete(void* frame) {
+    IOLoop::release(frame);
+}
+
+void HttpCoroutine::promise_type::return_value(const HttpResponse& response) {
+    HttpResponse& reply = const_cast<HttpResponse&>(response);
+    this->handler->reply(this->request, reply.get_code(), reply.get_body());
+}
+
+void HttpCoroutine::promise_type::unhandled_exception() {
+    if (!this->request->done) {
+        this->handler->reply(this->request, 500);
+    }
+}
+
+// IOSleep
+
+IOSleep::IOSleep(IOLoop* const loop, const int& delay) {
+    this->loop = loop;
+    this->delay = delay;
+}
+
+bool IOSleep::await_ready() {
+    return this->delay <= 0;
+}
+
+void IOSleep::await_suspend(coroutine_handle<> waiter) {
+    this->waiter = waiter;
+    this->loop->add_timeout(this->delay, this);
+}
+
+void IOSleep::on_timeout() {
+    this->waiter.resume();
+}
+
+IOSleep IOLoop::sleep(const int& delay) {
+    return IOSleep(this, delay);
+}
+
+// HttpFetch
+
+/**
+ * HttpFetchHandler passes the outcome of a fetch to its awaitable. The
+ * client deletes it as any handler, back into the pool of the loop.
+ */
+class HttpFetchHandler : public HttpResponseHandler {
+    public:
+        HttpFetch* fetch;
+        static void* operator new(size_t size) {
+            return IOLoop::current()->allocate(size);
+        }
+        static void operator delete(void* handler) {
+            IOLoop::release(handler);
+        }
+        void handle(HttpResponse* const response) {
+            this->fetch->complete(response, "");
+        }
+        void handle_error(const string& error) {
+            this->fetch->complete(NULL, error);
+        }
+};
+
+HttpFetch::HttpFetch(AsyncHttpClient* const client, const string& host,
+    const int& port, const string& method, const string& path, 
+    const string& body) : response(0) {
+    HttpFetchHandler* handler = new HttpFetchHandler();
+    handler->fetch = this;
+    this->client = client;
+    this->done = false;
+    try {
+        this->id = client->fetch(host, port, method, path, body, handler);
+    } catch (...) {
+        delete handler;
+        throw;
+    }
+}
+
+HttpFetch::~HttpFetch() {
+    if (!this->done) {
+        this->client->cancel(this->id);
+    }
+}
+
+void HttpFetch::complete(HttpResponse* const response, const string& error) {
+    this->done = true;
+    if (response != NULL) {
+        this->response.code = response->code;
+        this->response.body.swap(response->body);
+    } else {
+        this->error = error;
+    }
+    if (this->waiter) {
+        this->waiter.resume();
+    }
+}
+
+void HttpFetch::await_suspend(coroutine_handle<> waiter) {
+    this->waiter = waiter;
+}
+
+HttpResponse HttpFetch::await_resume() {
+    if (!this->error.empty()) {
+        throw runtime_error(this->error);
+    }
+    return move(this->response);
+}
+
+HttpFetch AsyncHttpClient::fetch(const string& host, const int& port, 
+    const string& method, const string& path, const string& body) {
+    return HttpFetch(this, host, port, method, path, body);
+}
+
+// HttpBodyRead
+
+HttpBodyRead::HttpBodyRead(HttpRequest* const request) {
+    this->request = request;
+}
+
+bool HttpBodyRead::await_ready() {
+    return !this->request->body.empty() || this->request->server == NULL ||
+        this->request->received == this->request->length;
+}
+
+void HttpBodyRead::await_suspend(coroutine_handle<> waiter) {
+    this->waiter = waiter;
+    this->request->reader = this;
+}
+
+string HttpBodyRead::await_resume() {
+    string pieces;
+    pieces.swap(this->request->body);
+    if (pieces.empty() && this->request->server == NULL &&
+        this->request->received < this->request->length) {
+        throw runtime_error("Connection closed");
+    }
+    return pieces;
+}
+
+// HttpCoroutineHandler
+
+void HttpCoroutineHandler::on_headers(HttpRequest* const request,
+    const vector<string>& args) {
+    // the coroutine runs until it first waits, or replies right away
+    this->defer(request);
+    this->handle(request, args);
+}
+
+void HttpCoroutineHandler::on_body_chunk(HttpRequest* const request,
+    const char* data, const size_t& size) {
+    request->body.append(data, size);
+    if (request->reader != NULL) {
+        HttpBodyRead* reader = request->reader;
+        request->reader = NULL;
+        reader->waiter.resume();
+    }
+}
+
+void HttpCoroutineHandler::on_body_end(HttpRequest* const request,
+    const vector<string>& args) {
+    if (request->reader != NULL) {
+        HttpBodyRead* reader = request->reader;
+        request->reader = NULL;
+        reader->waiter.resume();
+    }
+}
+
+void HttpCoroutineHandler::on_abort(HttpRequest* const request) {
+    this->on_body_end(request, request->args);
+}
+
+HttpBodyRead HttpCoroutineHandler::read(HttpRequest* const request) {
+    return HttpBodyRead(request);
+}
+
+#endif
@@ -6,11 +6,44 @@
 #define EPOLL_SIZE      64
 #define MAX_EVENTS      128
 #define MAX_NMATCH      16
+#define RETRY_AFTER     1
+#define MAX_HEAD_SIZE   8192
+#define BODY_RESERVE    65536
+#define DNS_PORT        53
+#define DNS_TIMEOUT     1000
+#define DNS_ATTEMPTS    3
+#define DNS_NEGATIVE_TTL 30
+#define RESOLV_CONF     "/etc/resolv.conf"
+#define HOSTS_FILE      "/etc/hosts"
+#define PIPE_SIZE       65536
+#define MAX_MESSAGE_SIZE 16777216
+#define TLS_SESSION_CACHE_SIZE 1024
+#define POOL_GRANULE    64
+#define MAX_POOLED_SIZE 4096
+#define MAX_POOLED_BLOCKS 256
+#define H2_MAX_STREAMS  100
+#define H2_WINDOW_SIZE  65535
+#define H2_FRAME_SIZE   16384
+#define H2_TABLE_SIZE   4096
+#define TRACE_RING_SIZE 4096
+#define RETRY_RATIO     0.1
+#define RETRY_RESERVE   10
+#define LATENCY_SAMPLES 128
+#define HEDGE_MIN_SAMPLES 20
+#define EVENT_HIGH_WATER 1048576
+#define MULTIPART_MEMORY_LIMIT 65536
+#define MULTIPART_SPOOL_DIR "/tmp"
+#define MULTIPART_MAX_PARTS 256
 
 #include <map>
+#include <set>
+#include <list>
 #include <string>
 #include <vector>
 #include <utility>
+#if __cplusplus >= 202002L
+#include <coroutine>
+#endif
 
 using namespace std;
 
@@ -18,32 +51,68 @@ class IOLoop;
 class AsyncHttpServer;
 class HttpRequestHandler;
 class HttpResponseHandler;
+class HttpBatch;
+class HttpBatchMember;
+class HttpRetry;
+class HttpRetryAttempt;
+class DnsQuery;
+class DnsSearch;
+class HttpResolution;
+class HttpFallback;
+class HttpProxyConnection;
+class WebSocketConnection;
+class HttpEventQueue;
+class HttpEventBuffer;
+class HttpMultipartForm;
+class Http2Connection;
+struct ssl_ctx_st;
+struct ssl_st;
+struct ssl_session_st;
+class HttpFetch;
+class HttpBodyRead;
+class HttpCoroutineHandler;
+class IOSleep;
+class IOTraceSlot;
 
 /**
  * HttpRequest provides access to data of an HTTP request. In general cases,
  * AsyncHttpServer creates objects of this class automatically and provides
  * them in methods of HttpReqestHandler, which you inherit in order to build
  * your own handler.
- *
- * TODO: (1) Code from_sequence() to parse more data, like headers, and make
- *           them available via getting methods, e.g. get_headers("XYZ").
  */
 class HttpRequest {
     friend class AsyncHttpServer;
     friend class HttpRequestHandler;
+    friend class HttpCoroutine;
+    friend class HttpCoroutineHandler;
+    friend class HttpBodyRead;
+    friend class Http2Connection;
+    friend class HttpMultipartHandler;
     private:
         string method;
         string path;
+        string version;
         string body;
+        map<string, string> headers;
+        size_t length;
+        size_t received;
+        vector<string> args;
+        HttpRequestHandler* handler;
         AsyncHttpServer* server;
         int fd;
         bool done;
+        bool deferred;
+        HttpBodyRead* reader;
+        int stream;
+        string flight;
+        bool leading;
     protected:
         /**
-         * Parses the sequence and returns a request if successful or NULL if
-         * not. The caller MUST delete the request when no longer used.
+         * Parses the request line and the headers of the sequence and returns
+         * a request without body if successful or NULL if not. The caller MUST
+         * delete the request when no longer used.
          *
-         * @param sequence the sequence to be parsed into an HttpRequest object
+         * @param sequence the head of a request, ending with an empty line
          */
         static HttpRequest* from_sequence(const string& sequence);
         /**
@@ -65,9 +134,30 @@ class HttpRequest {
          */
         const string& get_path();
         /**
-         * Returns the body.
+         * Returns the body. The body is empty if the handler of the request
+         * consumes it with on_body_chunk().
          */
         const string& get_body();
+        /**
+         * Returns the value of the header or an empty string if the header is
+         * not present. Names are case-insensitive.
+         *
+         * @param name the name of the header
+         */
+        const string& get_header(const string& name);
+        /**
+         * Returns all the headers, with names in lower case.
+         */
+        const map<string, string>& get_headers();
+        /**
+         * Returns the length of the body announced by Content-Length.
+         */
+        const size_t& get_length();
+        /**
+         * Returns the version of the request line, e.g. HTTP/1.1, or an empty
+         * string for requests of HTTP/2.
+         */
+        const string& get_version();
 };
 
 /**
@@ -84,6 +174,9 @@ class HttpRequest {
 class HttpResponse {
     friend class AsyncHttpClient;
     friend class AsyncHttpServer;
+    friend class HttpProxyHandler;
+    friend class HttpFetch;
+    friend class Http2Connection;
     private:
         int code;
         string body;
@@ -93,8 +186,10 @@ class HttpResponse {
          *
          * @param code the code of the response
          * @param body the body of the response
+         * @param headers the extra headers of the response
          */
-        static const string to_sequence(int code, const string& body="");
+        static const string to_sequence(int code, const string& body="",
+            const map<string, string>& headers=map<string, string>());
         /**
          * Parses the sequence and returns a response if successful or NULL if
          * not. The caller MUST delete the response when no longer used.
@@ -102,6 +197,7 @@ class HttpResponse {
          * @param sequence the sequence to be parsed into an HttpResponse object
          */
         static HttpResponse* from_sequence(const string& sequence);
+    public:
         /**
          * Constructor.
          *
@@ -109,7 +205,6 @@ class HttpResponse {
          * @param body the body of the response
          */
         HttpResponse(const int& code, const string& body="");
-    public:
         /**
          * Returns the code.
          */
@@ -124,6 +219,10 @@ class HttpResponse {
  * HttpRequestHandler handles HTTP requests on the server side. All handlers of
  * AsyncHttpServer must inherit this class and should implement the supported
  * methods accordingly.
+ *
+ * By default, the body is collected into the request and get() or post() is
+ * called once it is complete. A handler that wants the body as it arrives,
+ * e.g. to store an upload, overrides on_body_chunk() and on_body_end().
  */
 class HttpRequestHandler {
     friend class AsyncHttpServer;
@@ -137,11 +236,42 @@ class HttpRequestHandler {
          */
         void reply(HttpRequest* const request, const int& code,
             const string& body="");
+        /**
+         * Takes the connection of the request over from the server and returns
+         * its file descriptor, which the caller must close eventually. The
+         * server forgets the connection and the request counts as replied to.
+         * A TLS connection can only be taken over once the kernel encrypts
+         * it in both directions, and a stream of an HTTP/2 connection never
+         * can, otherwise this replies 501 and returns -1.
+         *
+         * @param request the HTTP request whose connection to take over
+         * @param pending set to the bytes after the head already read
+         */
+        int detach(HttpRequest* const request, string& pending);
+        /**
+         * Keeps the request open after the handler returns, so that reply()
+         * may be called later, e.g. from a timeout or from the handler of a
+         * fetch. The server then neither replies 500 at the end of the body
+         * nor deletes the request if the client goes away, see on_abort().
+         *
+         * @param request the HTTP request to reply to later
+         */
+        void defer(HttpRequest* const request);
     public:
         /**
          * Destructor.
          */
         virtual ~HttpRequestHandler() {}
+        /**
+         * Called when the head of the request has been read and before its
+         * body is. A handler may reply or detach() here already, in which case
+         * the body is not read by the server.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        virtual void on_headers(HttpRequest* const request,
+            const vector<string>& args);
         /**
          * Called when a HTTP GET request is available. The caller should
          * always manage to reply the request using method reply().
@@ -160,6 +290,35 @@ class HttpRequestHandler {
          */
         virtual void post(HttpRequest* const request,
             const vector<string>& args);
+        /**
+         * Called for each piece of the body as it is read from the network.
+         * The default appends the piece to the body of the request. A handler
+         * may reply here already, in which case the rest of the body is
+         * discarded.
+         *
+         * @param request the HTTP request
+         * @param data the piece of the body
+         * @param size the size of the piece
+         */
+        virtual void on_body_chunk(HttpRequest* const request,
+            const char* data, const size_t& size);
+        /**
+         * Called when the whole body has been read. The default calls get()
+         * or post() according to the method, or replies 405.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        virtual void on_body_end(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called when the client of a deferred request goes away before the
+         * reply. The handler must still call reply(), which then only deletes
+         * the request.
+         *
+         * @param request the HTTP request
+         */
+        virtual void on_abort(HttpRequest* const request) {}
 };
 
 /**
@@ -178,6 +337,155 @@ class HttpResponseHandler {
          * @param response the HTTP response
          */
         virtual void handle(HttpResponse* const response) {}
+        /**
+         * Called instead of handle() when the request fails after fetch() has
+         * returned, e.g. the connection breaks or the fetch is cancelled.
+         *
+         * @param error the description of the failure
+         */
+        virtual void handle_error(const string& error) {}
+};
+
+/**
+ * HttpBatchHandler handles the responses of a batch of requests made with
+ * AsyncHttpClient::fetch_all(). All batch handlers must inherit this class and
+ * implement method handle().
+ */
+class HttpBatchHandler {
+    public:
+        /**
+         * Destructor.
+         */
+        virtual ~HttpBatchHandler() {}
+        /**
+         * Called once when every request of the batch has either completed or
+         * failed. The i-th response answers the i-th request and is NULL if the
+         * request failed, in which case the i-th error describes the failure.
+         *
+         * @param responses the HTTP responses, in the order of the requests
+         * @param errors the errors, empty for the successful requests
+         */
+        virtual void handle(const vector<HttpResponse*>& responses,
+            const vector<string>& errors) {}
+};
+
+/**
+ * HttpClientRequest describes a request to be made by AsyncHttpClient, e.g.
+ * as a member of a batch.
+ */
+class HttpClientRequest {
+    public:
+        string host;
+        int port;
+        string method;
+        string path;
+        string body;
+        /**
+         * Constructor.
+         *
+         * @param host the name or the address of the target server
+         * @param port the port of the target server
+         * @param method the method of the request
+         * @param path the path of the request
+         * @param body the body of the request
+         */
+        HttpClientRequest(const string& host, const int& port,
+            const string& method, const string& path, const string& body="");
+};
+
+/**
+ * HttpRetryPolicy describes how AsyncHttpClient retries a request that fails,
+ * or gets 502, 503 or 504, and how it hedges a request that is slow to answer
+ * by making it again to another replica. Only requests of idempotent methods
+ * are made more than once.
+ */
+class HttpRetryPolicy {
+    public:
+        int attempts;
+        int backoff;
+        int max_backoff;
+        int hedge_delay;
+        double hedge_percentile;
+        vector<pair<string, int> > replicas;
+        /**
+         * Constructor. Retries wait for a random delay up to the backoff,
+         * doubled at each retry up to the maximum. Without hedge delay, a
+         * request is not hedged. Requests go to the host of the request and
+         * then to the replicas, in turn.
+         *
+         * @param attempts the maximum number of requests made, retries and
+         *        hedges included
+         * @param backoff the backoff before the first retry in milliseconds
+         * @param max_backoff the maximum backoff in milliseconds
+         * @param hedge_delay the delay in milliseconds after which a request
+         *        not answered yet is hedged, 0 for no hedge
+         * @param hedge_percentile once HEDGE_MIN_SAMPLES responses of the host
+         *        are known, the percentile of their latencies used as hedge
+         *        delay instead, 0 to stick to the delay
+         */
+        HttpRetryPolicy(const int& attempts=3, const int& backoff=100,
+            const int& max_backoff=2000, const int& hedge_delay=0,
+            const double& hedge_percentile=0.95);
+};
+
+/**
+ * SocketOptions tunes the TCP sockets of AsyncHttpServer and AsyncHttpClient,
+ * each option trading something for a latency that the traces of the loop
+ * show, see IOLoop::set_trace_sampling(). All are off by default, which
+ * leaves the kernel's defaults. Options of the TCP level do not apply to Unix
+ * domain sockets.
+ */
+class SocketOptions {
+    public:
+        // TCP_NODELAY, sends small writes right away instead of waiting for
+        // the ACK of what is in flight (Nagle), from response to last byte
+        bool nodelay;
+        // TCP_DEFER_ACCEPT, the seconds the server waits for the request
+        // before accepting the connection, which saves a wakeup per accept
+        int defer_accept;
+        // TCP_FASTOPEN, the queue length of the server for requests sent
+        // with the SYN, or any value for the client to send them so, which
+        // saves a round trip per connection to a host seen before
+        int fastopen;
+        // TCP_QUICKACK, ACKs what is read right away, re-armed at each read
+        // as the kernel falls back to delayed ACKs, which helps peers held
+        // back by Nagle
+        bool quickack;
+        // SO_SNDBUF and SO_RCVBUF in bytes, 0 for the kernel's autotuning,
+        // the bytes in flight before a large response or body stalls
+        int send_buffer;
+        int receive_buffer;
+        // SO_KEEPALIVE, the seconds idle before probing, 0 for none, then
+        // the seconds between probes and the probes unanswered before the
+        // connection is dropped, which bounds how long a dead peer goes
+        // unnoticed
+        int keepalive_idle;
+        int keepalive_interval;
+        int keepalive_count;
+        // TCP_CORK, holds partial segments while a message is written and
+        // pushes them at its end, so that the head, the body and the TLS
+        // records go out in full segments
+        bool cork;
+        /**
+         * Constructor, with every option off.
+         */
+        SocketOptions();
+};
+
+/**
+ * TimeoutHandler handles timeouts scheduled with IOLoop::add_timeout(). The
+ * loop does not delete the handler after calling it.
+ */
+class TimeoutHandler {
+    public:
+        /**
+         * Destructor.
+         */
+        virtual ~TimeoutHandler() {}
+        /**
+         * Called when the timeout expires.
+         */
+        virtual void on_timeout() = 0;
 };
 
 /**
@@ -212,7 +520,8 @@ class IOHandler {
          */
         virtual void on_write(const int& fd) = 0;
         /**
-         * Called when the file descriptor is closed unexpectedly.
+         * Called when the file descriptor is closed unexpectedly. The handler
+         * must unset and close the file descriptor.
          *
          * @param fd the associated file descriptor
          */
@@ -220,181 +529,1838 @@ class IOHandler {
 };
 
 /**
- * AsyncHttpClient is an async HTTP client driven by an IO loop.
+ * DnsHandler handles the outcome of DnsResolver::resolve(). All handlers of
+ * DnsResolver must inherit this class and implement method handle().
  */
-class AsyncHttpClient : public IOHandler {
-    friend class IOLoop;
+class DnsHandler {
+    public:
+        /**
+         * Destructor.
+         */
+        virtual ~DnsHandler() {}
+        /**
+         * Called when the host is resolved.
+         *
+         * @param addresses the IPv4 and IPv6 addresses of the host, never empty
+         */
+        virtual void handle(const vector<string>& addresses) {}
+        /**
+         * Called when the host cannot be resolved.
+         *
+         * @param error the description of the failure
+         */
+        virtual void handle_error(const string& error) {}
+};
+
+/**
+ * DnsResolver resolves host names without blocking the IO loop. Names are
+ * looked up in the hosts file first and then queried over UDP for both A and
+ * AAAA records, with the search domains and the ndots option of RESOLV_CONF
+ * applied as the resolver of the libc does. Answers are cached for as long
+ * as their TTL allows, failures for the negative TTL of the zone, and each
+ * lookup of a cached name starts from the next address so that load rotates
+ * over the records.
+ */
+class DnsResolver : public IOHandler {
+    friend class DnsQuery;
+    friend class DnsSearch;
     private:
         IOLoop* loop;
-        map<int, HttpResponseHandler*> handlers;
+        vector<pair<string, int> > nameservers;
+        vector<string> search;
+        int ndots;
+        map<string, vector<string> > hosts;
+        map<string, vector<string> > records;
+        map<string, long long> expiries;
+        map<string, size_t> cursors;
+        map<string, DnsQuery*> queries;
+        map<int, DnsQuery*> sockets;
+        int negative_ttl;
+        unsigned long long seed;
+        /**
+         * Returns the cached addresses of the name, starting from the next
+         * address in rotation.
+         *
+         * @param name the name of the host
+         */
+        vector<string> rotate(const string& name);
+        /**
+         * Looks the name up in the cache or queries it, as it is.
+         *
+         * @param name the fully qualified name of the host
+         * @param handler the handler to call with the addresses
+         */
+        void lookup(const string& name, DnsHandler* const handler);
+        /**
+         * Sends the query to the next nameserver, or completes the query with
+         * an error if all attempts are used.
+         *
+         * @param query the query to send
+         */
+        void send_query(DnsQuery* const query);
+        /**
+         * Caches the outcome of the query and reports it to its handlers.
+         *
+         * @param query the query to complete
+         * @param error the description of the failure, if any
+         */
+        void complete(DnsQuery* const query, const string& error="");
     protected:
         /**
-         * Called when network data from the file descriptor is available.
+         * Called when an answer from a nameserver is available.
          *
          * @param fd the associated file descriptor
          */
         void on_read(const int& fd);
         /**
-         * Called when network buffer of the file descriptor is available.
+         * Not used, queries are sent without waiting.
          *
          * @param fd the associated file descriptor
          */
         void on_write(const int& fd);
         /**
-         * Called when the file descriptor is closed unexpectedly. 
+         * Called when the socket of a query fails.
          *
-         * @param fd the associted file descriptor
+         * @param fd the associated file descriptor
          */
         void on_close(const int& fd);
     public:
         /**
-         * Constructor.
+         * Constructor. This reads the nameservers, the search domains and the
+         * ndots option from RESOLV_CONF and the hosts from HOSTS_FILE.
          *
-         * @param loop the IO loop that drives the client
+         * @param loop the IO loop that drives the resolver
          */
-        AsyncHttpClient(IOLoop* const loop=NULL);
-       /**
-         * Makes a request and handles the response by the handler. Note that,
-         * unlike AsyncHttpServer, this class deletes (de-allocate the memory
-         * of) the handler after it is called. Raises an exception if an error
-         * occurs.
+        DnsResolver(IOLoop* const loop=NULL);
+        /**
+         * Destructor. The lookups in flight fail with "Cancelled".
+         */
+        ~DnsResolver();
+        /**
+         * Resolves the host and handles the outcome by the handler, which is
+         * deleted after it is called. The handler is called right away if the
+         * host is an address, is in the hosts file or is cached.
          *
-         * @param host the host (in IP format) of the target server
-         * @param port the port of the target server
-         * @param method the method of the request
-         * @param path the path of the request
-         * @param body the body of the request
-         * @param handler the handler to call when the response is received
+         * @param host the name of the host
+         * @param handler the handler to call with the addresses
          */
-        void fetch(const string& host, const int& port, const string& method,
-            const string& path, const string& body,
-            HttpResponseHandler* const handler);
+        void resolve(const string& host, DnsHandler* const handler);
+        /**
+         * Replaces the nameservers with the given one, e.g. a local stub.
+         *
+         * @param address the IP address of the nameserver
+         * @param port the UDP port of the nameserver
+         */
+        void set_nameserver(const string& address, const int& port=DNS_PORT);
+        /**
+         * Replaces the hosts with those of the file, in /etc/hosts format.
+         *
+         * @param path the path of the file
+         */
+        void load_hosts(const string& path);
+        /**
+         * Sets how long, in seconds, a failure is cached when the nameserver
+         * does not tell, DNS_NEGATIVE_TTL by default.
+         *
+         * @param seconds the time to cache failures
+         */
+        void set_negative_ttl(const int& seconds);
+        /**
+         * Forgets all cached answers and failures.
+         */
+        void clear_cache();
 };
 
 /**
- * AsyncHttpServer is an async HTTP server driven by an IO loop.
+ * AsyncHttpClient is an async HTTP client driven by an IO loop.
  */
-class AsyncHttpServer : public IOHandler {
-    friend class HttpRequestHandler;
+class AsyncHttpClient : public IOHandler {
+    friend class IOLoop;
+    friend class HttpBatch;
+    friend class HttpBatchMember;
+    friend class HttpRetry;
+    friend class HttpRetryAttempt;
+    friend class HttpResolution;
+    friend class Http2Connection;
+    friend class Http2Resolution;
     private:
-        int fd;
         IOLoop* loop;
-        vector<pair<string, HttpRequestHandler*> > handlers;
-    protected:
+        DnsResolver* resolver;
+        bool resolver_owned;
+        map<int, HttpResponseHandler*> handlers;
+        map<int, HttpResolution*> resolutions;
+        map<int, HttpFallback*> fallbacks;
+        int next_id;
+        map<int, int> fetches;
+        map<int, int> ids;
+        map<int, string> hosts;
+        map<string, int> host_loads;
+        int max_per_host;
+        list<HttpBatch*> batches;
+        bool pumping;
+        bool repump;
+        ssl_ctx_st* tls_context;
+        string ca_file;
+        bool verify;
+        map<int, string> tls_names;
+        map<int, ssl_st*> tls_streams;
+        map<string, ssl_session_st*> tls_sessions;
+        bool http2;
+        map<string, Http2Connection*> h2_hosts;
+        map<int, Http2Connection*> h2_connections;
+        map<int, Http2Connection*> h2_fetches;
+        map<int, HttpRetry*> retries;
+        double retry_ratio;
+        double retry_tokens;
+        int retry_reserve;
+        unsigned long long retry_seed;
+        map<string, list<int> > latencies;
+        SocketOptions socket_options;
         /**
-         * Returns the handler whose pattern of interest matches the path
-         * and NULL if the handler is not found.
+         * Closes the file descriptor and reports the error to its handler if
+         * the response has not been handled yet.
          *
-         * @param path the path of the request
+         * @param fd the associated file descriptor
+         * @param error the description of the failure
          */
-        HttpRequestHandler* find_handler(const string& path);
+        void abort(const int& fd, const string& error);
         /**
-         * Returns the arguments according to the regex given when adding the
-         * associated handler to the server.
+         * Goes on with the TLS handshake of the file descriptor and returns
+         * true once it has completed. Otherwise waits for the socket or
+         * aborts the fetch if the handshake failed.
          *
-         * @param path the path of the request
+         * @param fd the associated file descriptor
          */
-        vector<string> get_arguments(const string& path);
+        bool handshake(const int& fd);
         /**
-         * Writes to the client of the file descriptor the response.
+         * Keeps the session of the file descriptor, if it can be resumed, for
+         * the next request over TLS to the same host.
          *
          * @param fd the associated file descriptor
-         * @param code the code of the response
-         * @param body the body of the response
          */
-        void reply(const int& fd, const int& code, const string& body="");
+        void keep_session(const int& fd);
         /**
-         * Called when network data from the file descriptor is available.
-         * 
-         * @param fd the associated file descriptor
+         * Sends the request over the connection and waits for the response.
+         *
+         * @param id the id of the fetch
+         * @param fd the file descriptor of the connection
+         * @param packet the HTTP request
+         * @param handler the handler to call when the response is received
          */
-        void on_read(const int& fd);
+        void start(const int& id, const int& fd, const string& packet,
+            HttpResponseHandler* const handler);
         /**
-         * Called when network buffer of the file descriptor is available.
-         * 
-         * @param fd the associated file descriptor
+         * Called when the host of a pending fetch is resolved or not.
+         *
+         * @param resolution the pending fetch
+         * @param addresses the addresses of the host, empty on failure
+         * @param error the description of the failure
          */
-        void on_write(const int& fd);
+        void resolved(HttpResolution* const resolution,
+            const vector<string>& addresses, const string& error="");
         /**
-         * Called when the file descriptor is closed unexpectedly.
+         * Connects the fetch to the first of the addresses that does not fail
+         * right away and starts it, keeping the others until it is connected,
+         * or fails the fetch if none is left.
          *
-         * @param fd the associated file descriptor
+         * @param id the id of the fetch
+         * @param port the port of the target server
+         * @param addresses the addresses of the host, in order
+         * @param packet the HTTP request
+         * @param handler the handler to call when the response is received
+         * @param error the description of the failure if none is left
          */
-        void on_close(const int& fd);
-    public:
+        void dial(const int& id, const int& port, 
+            const vector<string>& addresses, const string& packet,
+            HttpResponseHandler* const handler, const string& error);
         /**
-         * Constructor. This creates a socket and add the socket to the loop
-         * for notifications of read events.
+         * Moves the fetch of the file descriptor, whose connection failed, to
+         * the next address of its host and returns false if there is none.
          *
-         * @param port the port to bind and listen to
-         * @param loop the IO loop that drives the server
+         * @param fd the associated file descriptor
+         * @param error the description of the failure
          */
-        AsyncHttpServer(const int& port, IOLoop* const loop=NULL);
+        bool reconnect(const int& fd, const string& error);
         /**
-         * Destructor.
+         * Makes the fetch as a stream of the HTTP/2 connection to the host,
+         * connecting first if there is none, and returns the id of the fetch.
+         *
+         * @param key the host and the port of the fetch
+         * @param address the name or the address of the host
+         * @param port the port of the target server
+         * @param method the method of the request
+         * @param path the path of the request
+         * @param body the body of the request
+         * @param handler the handler to call when the response is received
          */
-        ~AsyncHttpServer();
+        int fetch_h2(const string& key, const string& address, 
+            const int& port, const string& method, const string& path,
+            const string& body, HttpResponseHandler* const handler);
         /**
-         * Adds the handler for requests matching the pattern. Note that, unlike
-         * AsyncHttpClient, this class keeps the handler until you explicitly
-         * delete (de-allocate the memory of) that handler yourself.
+         * Connects the HTTP/2 connection to the first of the addresses of its
+         * host that does not fail right away, keeping the others until it is
+         * connected, or fails its streams if none is left.
          *
-         * @param pattern the pattern associated with the handler
-         * @param handler the request handler for reqeusts matching the pattern
+         * @param connection the connection waiting for its host
+         * @param port the port of the target server
+         * @param addresses the addresses of the host, empty on failure
+         * @param error the description of the failure
          */
-        void add_handler(const string& pattern,
-            HttpRequestHandler* const handler);
+        void connect(Http2Connection* const connection, const int& port,
+            const vector<string>& addresses, const string& error="");
         /**
-         * Removes the first found handler of the pattern and returns the
-         * removed handler or NULL if no handler is removed.
+         * Hands the outcome of a fetch made over HTTP/2 to its handler, which
+         * is then deleted.
          *
-         * @param pattern the pattern associated with the handler
+         * @param id the id of the fetch
+         * @param handler the handler of the fetch
+         * @param response the HTTP response or NULL if the fetch failed
+         * @param error the description of the failure
          */
-        HttpRequestHandler* remove_handler(const string& pattern);
-};
-
-/**
- * IOLoop wraps epoll Edge Triggered and notifies registered handlers of network
- * events. Examples of handlers are AsyncHttpClient and AsyncHttpServer.
- *
- * TODO: (1) IOLoop runs forever at the moment. Maybe, adding timeout in start().
- */
-class IOLoop {
-    private:
-        int fd;
-        map<int, IOHandler*> handlers;
-        static IOLoop* loop;
-    public:
+        void complete(const int& id, HttpResponseHandler* const handler,
+            HttpResponse* const response, const string& error="");
         /**
-         * Constructor.
+         * Starts the waiting requests of the batches as far as the limits
+         * allow and completes the batches whose requests are all done.
          */
-        IOLoop();
+        void pump();
         /**
-         * Sets the handler for either read events or write events on the file
-         * descriptor and returns the previously set handler or NULL if no
-         * handler was previously set.
+         * Records the outcome of a request of the batch. The response, if any,
+         * is taken over by the batch.
          *
-         * @param fd the associated file descriptor
-         * @param handler the handler to notify of read events
-         * @param mode 'r' for read events or else for write events
+         * @param batch the batch of the request
+         * @param index the index of the request in the batch
+         * @param response the HTTP response or NULL if the request failed
+         * @param error the description of the failure
          */
-        IOHandler* set_handler(const int& fd, IOHandler* const handler,
-            char mode='r');
+        void record(HttpBatch* const batch, const int& index,
+            HttpResponse* const response, const string& error="");
         /**
-         * Unsets the handler for all events on the file descriptor and returns
-         * the previously set handler or NULL if no handler was previously set.
+         * Abandons the requests of the batch that are not done yet.
          *
-         * @param fd the associated file descriptor
+         * @param batch the batch whose deadline expires
          */
-        IOHandler* unset_handler(const int& fd);
+        void expire(HttpBatch* const batch);
         /**
-         * Starts the I/O loop forever.
+         * Makes the next request of the fetch under a policy, to the next of
+         * its hosts, and schedules its hedge if the policy says so.
+         *
+         * @param retry the fetch under a policy
          */
-        void start();
+        void launch(HttpRetry* const retry);
+        /**
+         * Called when the timeout of the fetch under a policy expires, which
+         * either hedges the request in flight or makes the retry waiting for
+         * its backoff.
+         *
+         * @param retry the fetch under a policy
+         */
+        void resume(HttpRetry* const retry);
+        /**
+         * Records the outcome of a request of the fetch under a policy and
+         * decides whether to retry, to wait for another request in flight or
+         * to hand the outcome over.
+         *
+         * @param retry the fetch under a policy
+         * @param index the index of the request in the fetch
+         * @param response the HTTP response or NULL if the request failed
+         * @param error the description of the failure
+         */
+        void settle(HttpRetry* const retry, const int& index,
+            HttpResponse* const response, const string& error="");
+        /**
+         * Hands the outcome of the fetch under a policy to its handler and
+         * cancels its requests still in flight.
+         *
+         * @param retry the fetch under a policy
+         * @param response the HTTP response or NULL if the fetch failed
+         * @param error the description of the failure
+         */
+        void finish(HttpRetry* const retry, HttpResponse* const response,
+            const string& error="");
+        /**
+         * Deletes the fetch under a policy once it is finished and none of
+         * its requests is in flight any more.
+         *
+         * @param retry the fetch under a policy
+         */
+        void release(HttpRetry* const retry);
+    protected:
+        /**
+         * Called when network data from the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_read(const int& fd);
+        /**
+         * Called when network buffer of the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_write(const int& fd);
+        /**
+         * Called when the file descriptor is closed unexpectedly. 
+         *
+         * @param fd the associted file descriptor
+         */
+        void on_close(const int& fd);
+    public:
+        /**
+         * Constructor.
+         *
+         * @param loop the IO loop that drives the client
+         */
+        AsyncHttpClient(IOLoop* const loop=NULL);
+        /**
+         * Destructor. This deletes the resolver the client created itself.
+         */
+        ~AsyncHttpClient();
+       /**
+         * Makes a request and handles the response by the handler, and returns
+         * the id of the fetch. Note that, unlike AsyncHttpServer, this class
+         * deletes (de-allocate the memory of) the handler after it is called.
+         * Raises an exception if an error occurs, in which case the handler is
+         * not taken over.
+         *
+         * @param host the name or the IPv4/IPv6 address of the target server;
+         *        names are resolved without blocking and their failures are
+         *        reported to the handler; "unix:" followed by a path, or by @
+         *        and a name in the abstract namespace, targets a Unix domain
+         *        socket and the port is ignored; a "tls:" prefix makes the
+         *        request over TLS, resuming the last session with the host
+         * @param port the port of the target server
+         * @param method the method of the request
+         * @param path the path of the request
+         * @param body the body of the request
+         * @param handler the handler to call when the response is received
+         */
+        int fetch(const string& host, const int& port, const string& method,
+            const string& path, const string& body,
+            HttpResponseHandler* const handler);
+        /**
+         * Makes the request under the policy and handles the outcome by the
+         * handler, which is deleted after it is called, and returns the id of
+         * the fetch. The first response that is not to be retried is handed
+         * over, and the requests still in flight are cancelled; otherwise the
+         * outcome of the last request is. Retries and hedges are drawn from
+         * the budget of the client, see set_retry_budget().
+         *
+         * @param request the request to make, first to its host
+         * @param policy the policy of the retries and of the hedges
+         * @param handler the handler to call when the fetch is done
+         */
+        int fetch(const HttpClientRequest& request,
+            const HttpRetryPolicy& policy, HttpResponseHandler* const handler);
+        /**
+         * Cancels the fetch if it is not done yet, in which case its handler
+         * is called with an error and deleted.
+         *
+         * @param id the id returned by fetch()
+         */
+        void cancel(const int& id);
+        /**
+         * Makes the requests and handles all their responses at once by the
+         * handler, which is deleted after it is called. Requests that cannot
+         * start yet because of the limits wait for a running one to finish.
+         *
+         * @param requests the requests to make
+         * @param handler the handler to call when every request is done
+         * @param concurrency the maximum number of requests of the batch
+         *        running at the same time, 0 for no limit
+         * @param deadline the time in milliseconds after which the requests
+         *        not done yet fail, 0 for no deadline
+         */
+        void fetch_all(const vector<HttpClientRequest>& requests,
+            HttpBatchHandler* const handler, const int& concurrency=0,
+            const int& deadline=0);
+        /**
+         * Sets the maximum number of requests running at the same time against
+         * one host and port, 0 (no limit) by default. Every fetch counts, but
+         * only the requests of batches wait for the limit.
+         *
+         * @param max the maximum number of requests per host
+         */
+        void set_max_per_host(const int& max);
+        /**
+         * Limits the retries and the hedges of the fetches under a policy so
+         * that a failing host is not hit harder, RETRY_RATIO and RETRY_RESERVE
+         * by default. Every such fetch earns the ratio of a request in the
+         * budget, up to the reserve, and every retry or hedge costs one.
+         *
+         * @param ratio the share of the fetches that may be made again
+         * @param reserve the maximum number of requests saved up
+         */
+        void set_retry_budget(const double& ratio, const int& reserve);
+        /**
+         * Sets the resolver for host names, which is not deleted by the
+         * client. By default, the client creates its own, which is deleted
+         * when replaced, failing the lookups it has in flight.
+         *
+         * @param resolver the resolver to use
+         */
+        void set_resolver(DnsResolver* const resolver);
+        /**
+         * Sets how servers are authenticated in requests over TLS. By default,
+         * certificates are verified against the system's trusted authorities.
+         *
+         * @param ca_file the PEM file of the trusted certificates, empty for
+         *        the system's
+         * @param verify false to accept any certificate
+         */
+        void set_tls_trust(const string& ca_file, const bool& verify=true);
+        /**
+         * Makes the requests over HTTP/2 with prior knowledge (h2c), which
+         * multiplexes the requests to one host and port over one connection,
+         * instead of one HTTP/1.0 connection per request. Requests over TLS
+         * are not affected.
+         *
+         * @param enabled true to speak HTTP/2
+         */
+        void set_http2(const bool& enabled);
+        /**
+         * Sets the options of the sockets connected from now on, none by
+         * default. With fastopen, the request goes out with the SYN once the
+         * host has handed out a cookie.
+         *
+         * @param options the options of the sockets
+         */
+        void set_socket_options(const SocketOptions& options);
+#if __cplusplus >= 202002L
+        /**
+         * Makes a request for a coroutine, which gets the response by
+         * awaiting the result. The request starts right away, so several
+         * can run at the same time before they are awaited.
+         *
+         * @param host the host as for the fetch() with a handler
+         * @param port the port of the target server
+         * @param method the method of the request
+         * @param path the path of the request
+         * @param body the body of the request
+         */
+        [[nodiscard]] HttpFetch fetch(const string& host, const int& port,
+            const string& method, const string& path, const string& body="");
+#endif
+};
+
+/**
+ * AsyncHttpServer is an async HTTP server driven by an IO loop. Besides
+ * HTTP/1.x, clients may speak HTTP/2 in cleartext (h2c), either with prior
+ * knowledge or by upgrading a request without body, in which case the streams
+ * of a connection are handled as requests of their own.
+ *
+ * Requests are traced as sampled by the loop, see
+ * IOLoop::set_trace_sampling(), and streams of HTTP/2 are sampled on their own.
+ */
+class AsyncHttpServer : public IOHandler {
+    friend class HttpRequestHandler;
+    friend class Http2Connection;
+    private:
+        set<int> listeners;
+        IOLoop* loop;
+        vector<pair<string, HttpRequestHandler*> > handlers;
+        int backlog;
+        int max_connections;
+        int retry_after;
+        string overload;
+        set<int> connections;
+        map<string, int> route_limits;
+        map<string, int> route_loads;
+        map<int, string> routes;
+        map<string, size_t> body_limits;
+        map<int, HttpRequest*> requests;
+        map<int, ssl_ctx_st*> tls_contexts;
+        map<int, ssl_st*> tls_streams;
+        map<int, Http2Connection*> h2_connections;
+        set<int> traced;
+        map<string, vector<string> > coalesced;
+        map<string, vector<HttpRequest*> > flights;
+        SocketOptions socket_options;
+        /**
+         * Sets the IO loop and the default limits.
+         *
+         * @param loop the IO loop that drives the server
+         */
+        void init(IOLoop* const loop);
+        /**
+         * Listens to the bound socket and adds it to the loop for
+         * notifications of read events.
+         *
+         * @param fd the file descriptor of the bound socket
+         */
+        int listen_to(const int& fd);
+        /**
+         * Goes on with the TLS handshake of the file descriptor and returns
+         * true once it has completed. Otherwise waits for the socket or
+         * closes it if the handshake failed.
+         *
+         * @param fd the associated file descriptor
+         */
+        bool handshake(const int& fd);
+    protected:
+        /**
+         * Returns the pattern of the first handler matching the path and an
+         * empty string if no pattern matches.
+         *
+         * @param path the path of the request
+         */
+        string find_pattern(const string& path);
+        /**
+         * Returns the handler whose pattern of interest matches the path
+         * and NULL if the handler is not found.
+         *
+         * @param path the path of the request
+         */
+        HttpRequestHandler* find_handler(const string& path);
+        /**
+         * Returns the arguments according to the regex given when adding the
+         * associated handler to the server.
+         *
+         * @param path the path of the request
+         */
+        vector<string> get_arguments(const string& path);
+        /**
+         * Writes to the client of the file descriptor the response.
+         *
+         * @param fd the associated file descriptor
+         * @param code the code of the response
+         * @param body the body of the response
+         */
+        void reply(const int& fd, const int& code, const string& body="");
+        /**
+         * Rejects the freshly accepted connection with the pre-serialized 503
+         * response and closes it without registering it to the loop.
+         *
+         * @param fd the associated file descriptor
+         */
+        void shed(const int& fd);
+        /**
+         * Checks the request against the routes and the limits and returns 0
+         * if it is taken in, counting it in flight on the pattern of its
+         * route, or the code to refuse it with otherwise.
+         *
+         * @param request the HTTP request
+         * @param pattern set to the pattern of the route of the request
+         */
+        int check(HttpRequest* const request, string& pattern);
+        /**
+         * Checks the request whose head has just been read against the routes
+         * and the limits, and returns true if its body should be read or false
+         * if a response has already been prepared.
+         *
+         * @param fd the associated file descriptor
+         * @param request the HTTP request
+         */
+        bool admit(const int& fd, HttpRequest* const request);
+        /**
+         * Makes the admitted request wait for the response to the same
+         * request in flight, if its route is coalesced, and returns true if
+         * it does. Otherwise the request, if coalesced, leads a new flight
+         * and is dispatched.
+         *
+         * @param request the HTTP request
+         * @param pattern the pattern of the route of the request
+         */
+        bool join(HttpRequest* const request, const string& pattern);
+        /**
+         * Ends the flight led by the request and replies to the requests
+         * waiting for it with the response, serialized once for all of them.
+         *
+         * @param request the HTTP request leading the flight
+         * @param code the code of the response
+         * @param body the body of the response
+         */
+        void land(HttpRequest* const request, const int& code,
+            const string& body);
+        /**
+         * Called when the client of the deferred request goes away, and
+         * returns true if the request is dealt with: a waiting request is
+         * forgotten, and a leading one goes on for the requests waiting for
+         * it. Otherwise the handler should be told with on_abort().
+         *
+         * @param request the HTTP request
+         */
+        bool forsake(HttpRequest* const request);
+        /**
+         * Forgets the connection of the file descriptor, without closing it,
+         * and returns the file descriptor or -1 if the connection is
+         * encrypted in user space.
+         *
+         * @param fd the associated file descriptor
+         * @param pending set to the bytes read but not consumed yet
+         */
+        int detach(const int& fd, string& pending);
+        /**
+         * Writes out the response to the deferred request of the file
+         * descriptor.
+         *
+         * @param fd the associated file descriptor
+         */
+        void resume(const int& fd);
+        /**
+         * Writes the response to the request, over HTTP/1.0 or over the
+         * stream of its HTTP/2 connection.
+         *
+         * @param request the HTTP request to reply to
+         * @param code the code of the response
+         * @param body the body of the response
+         */
+        void respond(HttpRequest* const request, const int& code,
+            const string& body);
+        /**
+         * Switches the connection of the file descriptor to HTTP/2 and returns
+         * true if more data is expected. The request, if any, asked for the
+         * switch with Upgrade: h2c and is answered as stream 1, under the
+         * settings of its HTTP2-Settings header, or with 400 and without
+         * switching if the header does not decode.
+         *
+         * @param fd the associated file descriptor
+         * @param request the HTTP request asking for the switch or NULL if the
+         *        client starts with the preface of HTTP/2
+         * @param pending the bytes read after the head of the request or,
+         *        without a request, all the bytes read so far
+         */
+        bool upgrade(const int& fd, HttpRequest* const request,
+            const string& pending);
+        /**
+         * Consumes data read from the file descriptor and returns true if
+         * more data is expected or false if a response has been prepared.
+         *
+         * @param fd the associated file descriptor
+         * @param data the data read
+         * @param size the size of the data
+         */
+        bool consume(const int& fd, const char* data, const size_t& size);
+        /**
+         * Called when network data from the file descriptor is available.
+         * 
+         * @param fd the associated file descriptor
+         */
+        void on_read(const int& fd);
+        /**
+         * Called when network buffer of the file descriptor is available.
+         * 
+         * @param fd the associated file descriptor
+         */
+        void on_write(const int& fd);
+        /**
+         * Called when the file descriptor is closed unexpectedly.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_close(const int& fd);
+    public:
+        /**
+         * Constructor. This creates a socket and add the socket to the loop
+         * for notifications of read events.
+         *
+         * @param port the port to bind and listen to
+         * @param loop the IO loop that drives the server
+         */
+        AsyncHttpServer(const int& port, IOLoop* const loop=NULL);
+        /**
+         * Constructor. This creates a Unix domain socket and add the socket to
+         * the loop for notifications of read events.
+         *
+         * @param path the path to bind and listen to, see add_listener()
+         * @param loop the IO loop that drives the server
+         */
+        AsyncHttpServer(const string& path, IOLoop* const loop=NULL);
+        /**
+         * Destructor. This closes the listening sockets.
+         */
+        ~AsyncHttpServer();
+        /**
+         * Listens to the TCP port too and returns the file descriptor of the
+         * listening socket. Raises an exception if an error occurs.
+         *
+         * @param port the port to bind and listen to
+         */
+        int add_listener(const int& port);
+        /**
+         * Listens to the Unix domain socket too and returns the file descriptor
+         * of the listening socket. Raises an exception if an error occurs.
+         *
+         * @param path the path of the socket, replaced if it exists, or its
+         *        name in the abstract namespace prefixed with @
+         */
+        int add_listener(const string& path);
+        /**
+         * Listens to the TCP port too, speaking TLS with the certificate, and
+         * returns the file descriptor of the listening socket. Sessions are
+         * resumed from tickets or from a cache of TLS_SESSION_CACHE_SIZE
+         * entries, and records are encrypted by the kernel after the
+         * handshake where kTLS is available. Raises an exception if an error
+         * occurs or if the library is built without TLS=1.
+         *
+         * @param port the port to bind and listen to
+         * @param cert_file the PEM file of the certificate chain
+         * @param key_file the PEM file of the private key
+         */
+        int add_listener(const int& port, const string& cert_file,
+            const string& key_file);
+        /**
+         * Adds the handler for requests matching the pattern. Note that, unlike
+         * AsyncHttpClient, this class keeps the handler until you explicitly
+         * delete (de-allocate the memory of) that handler yourself.
+         *
+         * @param pattern the pattern associated with the handler
+         * @param handler the request handler for reqeusts matching the pattern
+         */
+        void add_handler(const string& pattern,
+            HttpRequestHandler* const handler);
+        /**
+         * Removes the first found handler of the pattern and returns the
+         * removed handler or NULL if no handler is removed.
+         *
+         * @param pattern the pattern associated with the handler
+         */
+        HttpRequestHandler* remove_handler(const string& pattern);
+        /**
+         * Sets the length of the queue of pending connections of the listening
+         * socket, LISTEN_BACKLOG by default. The kernel caps the value at
+         * net.core.somaxconn.
+         *
+         * @param backlog the length of the queue of pending connections
+         */
+        void set_backlog(const int& backlog);
+        /**
+         * Sets the maximum number of concurrent connections, 0 (no limit) by
+         * default. Connections accepted beyond the limit are answered with 503
+         * right away and closed.
+         *
+         * @param max the maximum number of concurrent connections
+         */
+        void set_max_connections(const int& max);
+        /**
+         * Sets the options of the listening sockets, none by default, which
+         * the accepted sockets inherit. Throws if the kernel rejects one.
+         *
+         * @param options the options of the sockets
+         */
+        void set_socket_options(const SocketOptions& options);
+        /**
+         * Sets the maximum number of requests of the pattern being processed
+         * at the same time, 0 (no limit) by default. A request is in flight
+         * from its dispatch until its response is written out. Requests beyond
+         * the limit are answered with 503 without calling the handler.
+         *
+         * @param pattern the pattern associated with the handler
+         * @param max the maximum number of requests in flight
+         */
+        void set_max_in_flight(const string& pattern, const int& max);
+        /**
+         * Sets the maximum size of request bodies of the pattern, 0 (no limit)
+         * by default. Requests announcing a larger body are answered with 413
+         * before their body is read.
+         *
+         * @param pattern the pattern associated with the handler
+         * @param size the maximum size of the body in bytes
+         */
+        void set_max_body_size(const string& pattern, const size_t& size);
+        /**
+         * Coalesces the GET requests of the pattern without body, off by
+         * default: a request arriving while the same one is being handled
+         * waits for its response instead of being handled too. Requests are
+         * the same if their paths, and the values of the headers given, are.
+         * Handlers of such routes should not detach(), in which case the
+         * waiting requests get 503.
+         *
+         * @param pattern the pattern associated with the handler
+         * @param enabled true to coalesce the requests
+         * @param headers the names of the headers that tell requests apart,
+         *        e.g. Accept-Encoding
+         */
+        void set_coalescing(const string& pattern, const bool& enabled,
+            const vector<string>& headers=vector<string>());
+        /**
+         * Sets the value of Retry-After, in seconds, of 503 responses sent when
+         * the server is overloaded, 1 by default.
+         *
+         * @param seconds the delay suggested to the clients
+         */
+        void set_retry_after(const int& seconds);
+};
+
+/**
+ * HttpProxyHandler forwards the requests it handles to a pool of upstream
+ * servers, in turn, and the responses back to the clients. Bodies are not
+ * buffered: they are moved between the sockets with splice() through a pipe,
+ * or copied through a small buffer where splice() is not supported. Hop-by-hop
+ * headers are removed in both directions.
+ *
+ * The handler takes the connections over from the server as soon as the heads
+ * of the requests are read, so the limits of the server on the body size still
+ * apply but a request is no longer in flight once it is being forwarded.
+ */
+class HttpProxyHandler : public HttpRequestHandler, public IOHandler {
+    private:
+        IOLoop* loop;
+        vector<pair<string, int> > upstreams;
+        size_t next;
+        map<int, HttpProxyConnection*> connections;
+        /**
+         * Moves the exchange of the connection forward as far as the sockets
+         * allow.
+         *
+         * @param connection the proxied connection
+         */
+        void pump(HttpProxyConnection* const connection);
+        /**
+         * Moves up to remaining bytes from src to dst and returns 0 when done,
+         * 1 when waiting for the sockets or -1 on error. The remaining count
+         * is decreased unless it is string::npos, which means until src ends.
+         *
+         * @param connection the proxied connection
+         * @param src the file descriptor to read from
+         * @param dst the file descriptor to write to
+         * @param remaining the number of bytes to move
+         */
+        int transfer(HttpProxyConnection* const connection, const int& src,
+            const int& dst, size_t& remaining);
+        /**
+         * Closes both sides of the connection, replying 502 to the client
+         * first if nothing has been sent to it yet.
+         *
+         * @param connection the proxied connection
+         */
+        void finish(HttpProxyConnection* const connection);
+    protected:
+        /**
+         * Called when the head of the request has been read. This takes the
+         * connection over and connects to the next upstream server.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void on_headers(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called when network data from the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_read(const int& fd);
+        /**
+         * Called when network buffer of the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_write(const int& fd);
+        /**
+         * Called when the file descriptor is closed unexpectedly.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_close(const int& fd);
+    public:
+        /**
+         * Constructor.
+         *
+         * @param upstreams the addresses of the upstream servers, as
+         *        "address:port" with IPv6 addresses in brackets or as
+         *        "unix:path" for Unix domain sockets
+         * @param loop the IO loop that drives the proxy
+         */
+        HttpProxyHandler(const vector<string>& upstreams,
+            IOLoop* const loop=NULL);
+        /**
+         * Destructor. This closes the connections being proxied.
+         */
+        ~HttpProxyHandler();
+};
+
+/**
+ * WebSocketHandler accepts WebSocket connections (RFC 6455) on the routes it
+ * handles and exchanges messages over them on the IO loop of the server. You
+ * inherit this class and implement the methods on_open(), on_message() and
+ * on_disconnect() you need, and talk to the clients, identified by the file
+ * descriptors of their connections, with send_message().
+ *
+ * Fragmented messages are reassembled before on_message() is called, pings
+ * are answered automatically, and with set_ping_interval() clients that do
+ * not answer pings in time are disconnected.
+ */
+class WebSocketHandler : public HttpRequestHandler, public IOHandler,
+    public TimeoutHandler {
+    private:
+        IOLoop* loop;
+        map<int, WebSocketConnection*> connections;
+        int ping_interval;
+        int timeout;
+        /**
+         * Parses and handles the complete frames in the read buffer.
+         *
+         * @param fd the associated file descriptor
+         */
+        void parse(const int& fd);
+        /**
+         * Queues the frame and writes as much as the socket takes.
+         *
+         * @param fd the associated file descriptor
+         * @param opcode the opcode of the frame
+         * @param payload the payload of the frame
+         * @param fin whether the frame is the last of its message
+         */
+        void send_frame(const int& fd, const int& opcode,
+            const string& payload, const bool& fin=true);
+        /**
+         * Forgets and closes the connection and calls on_disconnect().
+         *
+         * @param fd the associated file descriptor
+         */
+        void drop(const int& fd);
+    protected:
+        /**
+         * Called when the head of the request has been read. This completes
+         * the opening handshake or replies 400 if the request is not a valid
+         * WebSocket upgrade.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void on_headers(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called when network data from the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_read(const int& fd);
+        /**
+         * Called when network buffer of the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_write(const int& fd);
+        /**
+         * Called when the file descriptor is closed unexpectedly.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_close(const int& fd);
+        /**
+         * Called when the ping interval expires.
+         */
+        void on_timeout();
+    public:
+        /**
+         * Constructor.
+         *
+         * @param loop the IO loop that drives the connections, which must be
+         *        the one of the server
+         */
+        WebSocketHandler(IOLoop* const loop=NULL);
+        /**
+         * Destructor. This closes the connections.
+         */
+        ~WebSocketHandler();
+        /**
+         * Called when a client has connected.
+         *
+         * @param fd the file descriptor of the connection
+         * @param request the HTTP request of the handshake
+         */
+        virtual void on_open(const int& fd, HttpRequest* const request) {}
+        /**
+         * Called when a complete message has been received.
+         *
+         * @param fd the file descriptor of the connection
+         * @param message the message
+         * @param binary whether the message is binary or text
+         */
+        virtual void on_message(const int& fd, const string& message,
+            const bool& binary) {}
+        /**
+         * Called when a pong has been received.
+         *
+         * @param fd the file descriptor of the connection
+         * @param payload the payload of the pong
+         */
+        virtual void on_pong(const int& fd, const string& payload) {}
+        /**
+         * Called when a connection is closed, for whatever reason. The file
+         * descriptor is closed right after.
+         *
+         * @param fd the file descriptor of the connection
+         */
+        virtual void on_disconnect(const int& fd) {}
+        /**
+         * Sends the message to the client, split into fragments of at most
+         * fragment_size bytes if fragment_size is not 0.
+         *
+         * @param fd the file descriptor of the connection
+         * @param message the message
+         * @param binary whether the message is binary or text
+         * @param fragment_size the maximum size of the fragments
+         */
+        void send_message(const int& fd, const string& message,
+            const bool& binary=false, const size_t& fragment_size=0);
+        /**
+         * Sends a ping to the client.
+         *
+         * @param fd the file descriptor of the connection
+         * @param payload the payload of the ping, at most 125 bytes
+         */
+        void send_ping(const int& fd, const string& payload="");
+        /**
+         * Starts the closing handshake with the client.
+         *
+         * @param fd the file descriptor of the connection
+         * @param code the status code of the closure
+         * @param reason the reason of the closure
+         */
+        void disconnect(const int& fd, const int& code=1000,
+            const string& reason="");
+        /**
+         * Pings every client at the interval, disconnecting those that have
+         * not answered the previous ping, 0 (no ping) by default.
+         *
+         * @param interval the interval in milliseconds
+         */
+        void set_ping_interval(const int& interval);
+};
+
+/**
+ * HttpEventHub streams Server-Sent Events to the clients that GET its routes,
+ * whose connections it takes over from the server and keeps open. You inherit
+ * this class and implement on_subscribe() and on_unsubscribe() if you need,
+ * and push events with publish() to every subscriber or with send() to one.
+ *
+ * An event is serialized once, into a buffer that the queues of all the
+ * subscribers share rather than copy, and queues are written out with one
+ * sendmsg() each. A subscriber reading slower than events come keeps at most
+ * the high-water mark queued: events beyond it are not queued for it, or it
+ * is disconnected, see set_high_water_mark(). Streams of HTTP/2 and TLS
+ * connections encrypted in user space cannot be taken over and get 501.
+ */
+class HttpEventHub : public HttpRequestHandler, public IOHandler {
+    private:
+        IOLoop* loop;
+        map<int, HttpEventQueue*> subscribers;
+        size_t high_water;
+        bool disconnect_slow;
+        /**
+         * Queues the event to the subscriber, or not if its queue is past the
+         * high-water mark, and writes as much as the socket takes.
+         *
+         * @param fd the file descriptor of the subscriber
+         * @param buffer the event
+         */
+        void queue(const int& fd, HttpEventBuffer* const buffer);
+        /**
+         * Forgets and closes the connection and calls on_unsubscribe().
+         *
+         * @param fd the file descriptor of the subscriber
+         */
+        void drop(const int& fd);
+    protected:
+        /**
+         * Called when the head of the request has been read. This takes the
+         * connection over and starts the stream of events, or replies 405 if
+         * the method is not GET.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void on_headers(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called when network data from the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_read(const int& fd);
+        /**
+         * Called when network buffer of the file descriptor is available.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_write(const int& fd);
+        /**
+         * Called when the file descriptor is closed unexpectedly.
+         *
+         * @param fd the associated file descriptor
+         */
+        void on_close(const int& fd);
+    public:
+        /**
+         * Constructor.
+         *
+         * @param loop the IO loop that drives the connections, which must be
+         *        the one of the server
+         */
+        HttpEventHub(IOLoop* const loop=NULL);
+        /**
+         * Destructor. This closes the connections.
+         */
+        ~HttpEventHub();
+        /**
+         * Called when a client has subscribed, e.g. to send() it the events it
+         * missed since the one of its Last-Event-ID header.
+         *
+         * @param fd the file descriptor of the subscriber
+         * @param request the HTTP request of the subscription
+         */
+        virtual void on_subscribe(const int& fd, HttpRequest* const request) {}
+        /**
+         * Called when a subscriber has gone or has been disconnected.
+         *
+         * @param fd the file descriptor of the former subscriber
+         */
+        virtual void on_unsubscribe(const int& fd) {}
+        /**
+         * Sends the event to every subscriber.
+         *
+         * @param data the data of the event, split in lines
+         * @param event the type of the event, empty for the default
+         * @param id the id of the event, empty for none
+         */
+        void publish(const string& data, const string& event="",
+            const string& id="");
+        /**
+         * Sends the event to the subscriber.
+         *
+         * @param fd the file descriptor of the subscriber
+         * @param data the data of the event, split in lines
+         * @param event the type of the event, empty for the default
+         * @param id the id of the event, empty for none
+         */
+        void send(const int& fd, const string& data, const string& event="",
+            const string& id="");
+        /**
+         * Closes the connection of the subscriber once the events queued to it
+         * are written out.
+         *
+         * @param fd the file descriptor of the subscriber
+         */
+        void disconnect(const int& fd);
+        /**
+         * Returns the number of subscribers.
+         */
+        size_t size();
+        /**
+         * Sets the maximum number of bytes queued to a subscriber,
+         * EVENT_HIGH_WATER by default. Events that would go past it are not
+         * queued to the subscriber, which misses them, or the subscriber is
+         * disconnected.
+         *
+         * @param bytes the high-water mark in bytes
+         * @param disconnect true to disconnect slow subscribers instead
+         */
+        void set_high_water_mark(const size_t& bytes,
+            const bool& disconnect=false);
+};
+
+/**
+ * HttpTraceHandler replies to GET requests with the trace of the loop of the
+ * server, see IOLoop::dump_trace(), e.g. on an admin route. Save the response
+ * to a file and load it in chrome://tracing or Perfetto.
+ */
+class HttpTraceHandler : public HttpRequestHandler {
+    public:
+        /**
+         * Called when a HTTP GET request is available.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void get(HttpRequest* const request, const vector<string>& args);
+};
+
+/**
+ * HttpFormPart is a part of a multipart/form-data body, see
+ * HttpMultipartHandler. The content of a part is kept in memory as long as it
+ * is small, and spooled to an anonymous temporary file otherwise, which goes
+ * away with the part unless it is saved.
+ */
+class HttpFormPart {
+    friend class HttpMultipartHandler;
+    private:
+        map<string, string> headers;
+        string name;
+        string filename;
+        string value;
+        int fd;
+        size_t size;
+        /**
+         * Constructor.
+         */
+        HttpFormPart();
+    public:
+        /**
+         * Destructor. This closes the temporary file if any.
+         */
+        ~HttpFormPart();
+        /**
+         * Returns the name of the field from Content-Disposition.
+         */
+        const string& get_name();
+        /**
+         * Returns the name of the uploaded file from Content-Disposition or
+         * an empty string if the part is not a file.
+         */
+        const string& get_filename();
+        /**
+         * Returns the value of the header of the part or an empty string if
+         * the header is not present. Names are case-insensitive.
+         *
+         * @param name the name of the header
+         */
+        const string& get_header(const string& name);
+        /**
+         * Returns all the headers of the part, with names in lower case.
+         */
+        const map<string, string>& get_headers();
+        /**
+         * Returns the size of the content read so far.
+         */
+        const size_t& get_size();
+        /**
+         * Returns the content if it is kept in memory, an empty string if it
+         * is spooled.
+         */
+        const string& get_value();
+        /**
+         * Returns the temporary file of the spooled content, positioned at its
+         * start once the part is complete, or -1 if the content is kept in
+         * memory. The file belongs to the part.
+         */
+        int get_fd();
+        /**
+         * Saves the content as a new file at the path, linking the temporary
+         * file to it if possible, and returns false and sets errno if it
+         * cannot.
+         *
+         * @param path the path of the file to create
+         */
+        bool save(const string& path);
+};
+
+/**
+ * HttpMultipartHandler handles requests with a multipart/form-data body, e.g.
+ * file uploads, which it parses as the body arrives instead of collecting it.
+ * You inherit this class and implement on_form(), and on_part() if you need
+ * to look at the parts as they come.
+ *
+ * Parts are kept in memory as long as they fit together in the memory limit
+ * and spooled to temporary files beyond it, so that the memory of an upload
+ * does not grow with its size. Requests that are not multipart/form-data get
+ * 415, malformed bodies 400, bodies with more parts than the maximum 413.
+ * The request is deferred, see defer(): on_form() may reply later, and
+ * on_abort() is called if the client goes away meanwhile.
+ */
+class HttpMultipartHandler : public HttpRequestHandler {
+    private:
+        map<HttpRequest*, HttpMultipartForm*> forms;
+        size_t memory_limit;
+        string spool_dir;
+        size_t max_parts;
+        /**
+         * Parses the piece of the body and returns 0, or the code to reply
+         * with if the body is malformed, has too many parts or cannot be
+         * spooled.
+         *
+         * @param request the HTTP request
+         * @param form the state of the parsing of the body
+         * @param data the piece of the body
+         * @param size the size of the piece
+         */
+        int parse(HttpRequest* const request, HttpMultipartForm* const form,
+            const char* data, const size_t& size);
+        /**
+         * Adds the piece of content to the last part of the form, spooling it
+         * once the parts in memory go past the memory limit, and returns false
+         * if the temporary file fails.
+         *
+         * @param form the state of the parsing of the body
+         * @param data the piece of content
+         * @param size the size of the piece
+         */
+        bool store(HttpMultipartForm* const form, const char* data, 
+            const size_t& size);
+        /**
+         * Forgets the parsing of the body of the request and deletes its
+         * parts.
+         *
+         * @param request the HTTP request
+         */
+        void drop(HttpRequest* const request);
+    public:
+        /**
+         * Constructor.
+         *
+         * @param memory_limit the size in bytes up to which the contents of
+         *        the parts of a body are kept in memory
+         * @param spool_dir the directory of the temporary files
+         * @param max_parts the number of parts of a body beyond which it gets
+         *        413, which also bounds its temporary files
+         */
+        HttpMultipartHandler(const size_t& memory_limit=MULTIPART_MEMORY_LIMIT,
+            const string& spool_dir=MULTIPART_SPOOL_DIR,
+            const size_t& max_parts=MULTIPART_MAX_PARTS);
+        /**
+         * Destructor. This deletes the parts of the bodies being read.
+         */
+        virtual ~HttpMultipartHandler();
+        /**
+         * Called when the head of the request has been read. This checks the
+         * content type, or replies 415, and starts parsing.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void on_headers(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called for each piece of the body as it is read from the network,
+         * which is parsed rather than collected.
+         *
+         * @param request the HTTP request
+         * @param data the piece of the body
+         * @param size the size of the piece
+         */
+        void on_body_chunk(HttpRequest* const request, const char* data, 
+            const size_t& size);
+        /**
+         * Called when the whole body has been read. This calls on_form() with
+         * the parts, or replies 400 if the body is cut short.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        void on_body_end(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Called when the client goes away before the reply. This deletes the
+         * parts read so far if on_form() has not been called yet. A subclass
+         * that overrides it must call it.
+         *
+         * @param request the HTTP request
+         */
+        void on_abort(HttpRequest* const request);
+        /**
+         * Called when the headers of a part have been read, before its
+         * content is. The handler may reply here already, in which case the
+         * rest of the body is discarded.
+         *
+         * @param request the HTTP request
+         * @param part the part, whose content is still empty
+         */
+        virtual void on_part(HttpRequest* const request, 
+            HttpFormPart* const part) {}
+        /**
+         * Called when the whole body has been parsed. The caller should always
+         * manage to reply the request using method reply(), now or later. The
+         * parts are deleted when this returns, save() those to keep.
+         *
+         * @param request the HTTP request
+         * @param parts the parts of the body, in order
+         */
+        virtual void on_form(HttpRequest* const request, 
+            const vector<HttpFormPart*>& parts);
+};
+
+/**
+ * IOTraceEvent is an event traced by IOLoop, an instant or a span
+ * in the life of a sampled request.
+ */
+struct IOTraceEvent {
+    // a string literal, which is not copied
+    const char* name;
+    // the file descriptor of the connection
+    int fd;
+    // the HTTP/2 stream or 0
+    int stream;
+    // in microseconds, see IOLoop::micros()
+    long long start;
+    // in microseconds, or -1 for an instant
+    long long duration;
+};
+
+/**
+ * IOLoopStats counts how the IO loop waits for events, e.g. to weigh the CPU
+ * spent spinning against the events it caught, see IOLoop::set_busy_poll().
+ */
+struct IOLoopStats {
+    // epoll_wait() calls with a zero timeout, while spinning
+    unsigned long long polls;
+    // spins that caught events
+    unsigned long long hits;
+    // spins that ran out and went on blocking
+    unsigned long long misses;
+    // blocking epoll_wait() calls
+    unsigned long long waits;
+    // events notified to the handlers
+    unsigned long long events;
+    // of those, events caught while spinning
+    unsigned long long spun_events;
+    // in microseconds
+    unsigned long long spin_time;
+    // the spin time as adapted to the events, in microseconds
+    int spin;
+};
+
+/**
+ * IOLoop wraps epoll Edge Triggered and notifies registered handlers of network
+ * events. Examples of handlers are AsyncHttpClient and AsyncHttpServer.
+ *
+ * TODO: (1) IOLoop runs forever at the moment. Maybe, adding timeout in start().
+ */
+class IOLoop {
+    private:
+        int fd;
+        map<int, IOHandler*> handlers;
+        int next_timeout;
+        map<pair<long long, int>, TimeoutHandler*> timeouts;
+        map<int, long long> deadlines;
+        vector<void*> pool;
+        vector<int> pool_sizes;
+        int trace_rate;
+        unsigned long long trace_seed;
+        int busy_poll;
+        int socket_poll;
+        IOLoopStats stats;
+        IOTraceSlot* trace_ring;
+        unsigned long trace_next;
+        static IOLoop* loop;
+        /**
+         * Calls the handlers of the expired timeouts and returns the time in
+         * milliseconds until the next one or -1 if none is scheduled.
+         */
+        int run_timeouts();
+        /**
+         * Waits for events as epoll_wait() does, spinning first if busy
+         * polling is on, and adapts the spin time to what the wait caught.
+         *
+         * @param events the events to fill
+         * @param timeout the timeout in milliseconds or -1 for none
+         */
+        int wait(struct epoll_event* const events, const int& timeout);
+    public:
+        /**
+         * Constructor.
+         */
+        IOLoop();
+        /**
+         * Sets the handler for either read events or write events on the file
+         * descriptor and returns the previously set handler or NULL if no
+         * handler was previously set.
+         *
+         * @param fd the associated file descriptor
+         * @param handler the handler to notify of read events
+         * @param mode 'r' for read events, 'a' for both read and write events
+         *        or else for write events
+         */
+        IOHandler* set_handler(const int& fd, IOHandler* const handler,
+            char mode='r');
+        /**
+         * Unsets the handler for all events on the file descriptor and returns
+         * the previously set handler or NULL if no handler was previously set.
+         *
+         * @param fd the associated file descriptor
+         */
+        IOHandler* unset_handler(const int& fd);
+        /**
+         * Schedules the handler to be called once after the delay and returns
+         * the id of the timeout.
+         *
+         * @param delay the delay in milliseconds
+         * @param handler the handler to call
+         */
+        int add_timeout(const int& delay, TimeoutHandler* const handler);
+        /**
+         * Cancels the timeout and returns true if it was still scheduled.
+         *
+         * @param id the id returned by add_timeout()
+         */
+        bool remove_timeout(const int& id);
+        /**
+         * Returns the time in milliseconds of a monotonic clock.
+         */
+        static long long now();
+        /**
+         * Returns the time in microseconds of the monotonic clock of now().
+         */
+        static long long micros();
+        /**
+         * Traces one request in every rate on average, sampled at random, 0
+         * (none) by default. The loop keeps the last TRACE_RING_SIZE events of
+         * the traced requests, from the accept to the last byte written, see
+         * dump_trace(). Set it before starting the loop.
+         *
+         * @param rate the number of requests per traced request
+         */
+        void set_trace_sampling(const int& rate);
+        /**
+         * Returns true if the request about to start should be traced,
+         * according to the rate of set_trace_sampling().
+         */
+        bool sample();
+        /**
+         * Records the event of a traced request in the ring, overwriting the
+         * oldest one once the ring is full. Only the thread of the loop
+         * records events.
+         *
+         * @param name the name of the event, a string literal
+         * @param fd the file descriptor of the connection
+         * @param stream the HTTP/2 stream of the request or 0
+         * @param start the time of the event, see micros()
+         * @param duration the duration of the span or -1 for an instant
+         */
+        void trace(const char* name, const int& fd, const int& stream,
+            const long long& start, const long long& duration=-1);
+        /**
+         * Returns the events in the ring, oldest first, in the JSON format of
+         * Chrome traces, with a row per connection. It takes no lock and may
+         * be called from any thread: events overwritten while they are being
+         * copied are left out.
+         */
+        string dump_trace();
+        /**
+         * Spins on the events without blocking for up to the budget before
+         * blocking, off (0) by default, which trades CPU for the latency of
+         * waking up. The spin time adapts to the events: it shrinks while
+         * spinning catches nothing and grows back when events come soon after
+         * blocking. See get_stats() for what the spinning catches.
+         *
+         * @param budget the maximum spin time in microseconds
+         * @param socket_poll the time in microseconds the kernel may busy poll
+         *        the device of the sockets set from now on, with SO_BUSY_POLL
+         *        and SO_PREFER_BUSY_POLL, 0 to leave them as they are
+         */
+        void set_busy_poll(const int& budget, const int& socket_poll=0);
+        /**
+         * Returns the counts of how the loop has waited for events so far.
+         */
+        IOLoopStats get_stats();
+        /**
+         * Allocates memory from the pool of the loop, e.g. for coroutine
+         * frames, which must be released by release() from the thread of the
+         * loop. Blocks up to MAX_POOLED_SIZE bytes are recycled.
+         *
+         * @param size the size of the memory
+         */
+        void* allocate(const size_t& size);
+        /**
+         * Returns the memory to the pool of the loop it was allocated from.
+         *
+         * @param memory the memory returned by allocate()
+         */
+        static void release(void* const memory);
+        /**
+         * Returns the loop started on the calling thread, or instance() if
+         * none is.
+         */
+        static IOLoop* current();
+#if __cplusplus >= 202002L
+        /**
+         * Returns an awaitable that resumes the coroutine after the delay.
+         *
+         * @param delay the delay in milliseconds
+         */
+        [[nodiscard]] IOSleep sleep(const int& delay);
+#endif
+        /**
+         * Starts the I/O loop forever.
+         */
+        void start();
         /**
          * Returns the singleton instance of the I/O loop.
          */
         static IOLoop* instance();
 };
 
+#if __cplusplus >= 202002L
+
+/**
+ * IOTask is the return type of coroutines run for their effects, e.g. the
+ * client side of a program. A task starts right away, runs on the loop once
+ * suspended, and its frame comes from the pool of the loop. Exceptions that
+ * escape a task propagate to whoever resumed it, usually the loop.
+ */
+class IOTask {
+    public:
+        class promise_type {
+            public:
+                static void* operator new(size_t size);
+                static void operator delete(void* frame);
+                IOTask get_return_object() { return IOTask(); }
+                suspend_never initial_suspend() { return suspend_never(); }
+                suspend_never final_suspend() noexcept {
+                    return suspend_never();
+                }
+                void return_void() {}
+                void unhandled_exception() { throw; }
+        };
+};
+
+/**
+ * HttpCoroutine is the return type of HttpCoroutineHandler::handle(). The
+ * response the coroutine returns with co_return is the reply to the request,
+ * or 500 if an exception escapes it.
+ */
+class HttpCoroutine {
+    public:
+        class promise_type {
+            private:
+                HttpCoroutineHandler* handler;
+                HttpRequest* request;
+            public:
+                /**
+                 * Constructor, from the handler and the arguments of
+                 * handle(), whose class is that of the handler.
+                 */
+                template <class Handler>
+                promise_type(Handler& handler, HttpRequest* const request,
+                    const vector<string>& args) {
+                    this->handler = &handler;
+                    this->request = request;
+                }
+                static void* operator new(size_t size);
+                static void operator delete(void* frame);
+                HttpCoroutine get_return_object() { return HttpCoroutine(); }
+                suspend_never initial_suspend() { return suspend_never(); }
+                suspend_never final_suspend() noexcept {
+                    return suspend_never();
+                }
+                void return_value(const HttpResponse& response);
+                void unhandled_exception();
+        };
+};
+
+/**
+ * IOSleep is the awaitable returned by IOLoop::sleep().
+ */
+class IOSleep : public TimeoutHandler {
+    private:
+        IOLoop* loop;
+        int delay;
+        coroutine_handle<> waiter;
+    public:
+        /**
+         * Constructor.
+         *
+         * @param loop the loop to sleep on
+         * @param delay the delay in milliseconds
+         */
+        IOSleep(IOLoop* const loop, const int& delay);
+        bool await_ready();
+        void await_suspend(coroutine_handle<> waiter);
+        void await_resume() {}
+        /**
+         * Resumes the coroutine.
+         */
+        void on_timeout();
+};
+
+/**
+ * HttpFetch is the awaitable returned by AsyncHttpClient::fetch() for
+ * coroutines. Awaiting it gives the response or raises a runtime_error with
+ * the description of the failure. A fetch destroyed before it is awaited is
+ * cancelled.
+ */
+class HttpFetch {
+    friend class HttpFetchHandler;
+    private:
+        AsyncHttpClient* client;
+        int id;
+        bool done;
+        coroutine_handle<> waiter;
+        HttpResponse response;
+        string error;
+        /**
+         * Called by the handler of the fetch with the response, or NULL and
+         * the description of the failure.
+         *
+         * @param response the HTTP response or NULL if the request failed
+         * @param error the description of the failure
+         */
+        void complete(HttpResponse* const response, const string& error);
+    public:
+        /**
+         * Constructor. This starts the request.
+         */
+        HttpFetch(AsyncHttpClient* const client, const string& host,
+            const int& port, const string& method, const string& path,
+            const string& body);
+        HttpFetch(const HttpFetch& other) = delete;
+        /**
+         * Destructor. This cancels the request if it is not done.
+         */
+        ~HttpFetch();
+        bool await_ready() { return this->done; }
+        void await_suspend(coroutine_handle<> waiter);
+        HttpResponse await_resume();
+};
+
+/**
+ * HttpBodyRead is the awaitable returned by HttpCoroutineHandler::read().
+ */
+class HttpBodyRead {
+    friend class HttpCoroutineHandler;
+    private:
+        HttpRequest* request;
+        coroutine_handle<> waiter;
+    public:
+        /**
+         * Constructor.
+         *
+         * @param request the HTTP request whose body to read
+         */
+        HttpBodyRead(HttpRequest* const request);
+        bool await_ready();
+        void await_suspend(coroutine_handle<> waiter);
+        string await_resume();
+};
+
+/**
+ * HttpCoroutineHandler is the base of handlers written as coroutines, which
+ * implement method handle() and reply to the request with co_return. The
+ * handler may await the body with read(), responses of AsyncHttpClient and
+ * IOLoop::sleep() in between.
+ */
+class HttpCoroutineHandler : public HttpRequestHandler {
+    friend class HttpCoroutine;
+    protected:
+        /**
+         * Starts handle() once the head of the request has been read.
+         */
+        void on_headers(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Keeps the piece of the body for read().
+         */
+        void on_body_chunk(HttpRequest* const request, const char* data,
+            const size_t& size);
+        /**
+         * Resumes read() at the end of the body.
+         */
+        void on_body_end(HttpRequest* const request,
+            const vector<string>& args);
+        /**
+         * Makes read() raise a runtime_error once the client has gone away.
+         */
+        void on_abort(HttpRequest* const request);
+        /**
+         * Returns an awaitable that gives the pieces of the body read since
+         * the last call, as soon as there are some, and an empty string at the
+         * end of the body.
+         *
+         * @param request the HTTP request whose body to read
+         */
+        [[nodiscard]] HttpBodyRead read(HttpRequest* const request);
+    public:
+        /**
+         * Called as a coroutine when the head of the request has been read.
+         * The request stays valid until the coroutine returns.
+         *
+         * @param request the HTTP request
+         * @param args the arguments associated with the regex of the handler
+         */
+        virtual HttpCoroutine handle(HttpRequest* const request,
+            const vector<string>& args) = 0;
+};
+
+#endif
+
 #endif